@@ -36,70 +36,37 @@
 #include <linux/sched.h>
 #include <linux/wait.h>
 
+#include "spi-bcm2835-engine.h"
+
 /* define some DEBUG pins */
 #include "bcm2835-gpio-debugpin.h"
 DEFINE_DEBUG_PIN()  /* used to mark "in worker thread"  */
 DEFINE_DEBUG_PIN(2) /* used to mark "waiting on wakeup" */
 DEFINE_DEBUG_PIN(3) /* used to mark "in SPI-interrupt"  */
 
-/* SPI register offsets */
-#define SPI_CS			0x00
-#define SPI_FIFO		0x04
-#define SPI_CLK			0x08
-#define SPI_DLEN		0x0c
-#define SPI_LTOH		0x10
-#define SPI_DC			0x14
-
-/* Bitfields in CS */
-#define SPI_CS_LEN_LONG		0x02000000
-#define SPI_CS_DMA_LEN		0x01000000
-#define SPI_CS_CSPOL2		0x00800000
-#define SPI_CS_CSPOL1		0x00400000
-#define SPI_CS_CSPOL0		0x00200000
-#define SPI_CS_RXF		0x00100000
-#define SPI_CS_RXR		0x00080000
-#define SPI_CS_TXD		0x00040000
-#define SPI_CS_RXD		0x00020000
-#define SPI_CS_DONE		0x00010000
-#define SPI_CS_LEN		0x00002000
-#define SPI_CS_REN		0x00001000
-#define SPI_CS_ADCS		0x00000800
-#define SPI_CS_INTR		0x00000400
-#define SPI_CS_INTD		0x00000200
-#define SPI_CS_DMAEN		0x00000100
-#define SPI_CS_TA		0x00000080
-#define SPI_CS_CSPOL		0x00000040
-#define SPI_CS_CLEAR_RX		0x00000020
-#define SPI_CS_CLEAR_TX		0x00000010
-#define SPI_CS_CPOL		0x00000008
-#define SPI_CS_CPHA		0x00000004
-#define SPI_CS_CS_10		0x00000002
-#define SPI_CS_CS_01		0x00000001
-
 #define SPI_TIMEOUT_MS	150
 
 #define DRV_NAME	"bcm2708_spi"
 
 struct bcm2708_spi {
 	spinlock_t lock;
-	void __iomem *base;
+	/* the fifo engine - with the registers */
+	struct bcm2835_spi_engine eng;
 	int irq;
 	struct clk *clk;
+	unsigned long clk_hz;
 	bool stopping;
 
 	struct list_head queue;
 	struct workqueue_struct *workq;
 	struct work_struct work;
 	struct completion done;
-
-	const u8 *tx_buf;
-	u8 *rx_buf;
-	int len;
 };
 
 struct bcm2708_spi_state {
 	u32 cs;
 	u16 cdiv;
+	u8 bits_per_word;
 };
 
 /*
@@ -130,58 +97,12 @@ static void bcm2708_init_pinmode(void)
 
 static inline u32 bcm2708_rd(struct bcm2708_spi *bs, unsigned reg)
 {
-	return readl(bs->base + reg);
+	return bcm2835_engine_rd(&bs->eng, reg);
 }
 
 static inline void bcm2708_wr(struct bcm2708_spi *bs, unsigned reg, u32 val)
 {
-	writel(val, bs->base + reg);
-}
-
-static inline void bcm2708_rd_fifo(struct bcm2708_spi *bs, int len)
-{
-	u8 byte;
-
-	while (len--) {
-		byte = bcm2708_rd(bs, SPI_FIFO);
-		if (bs->rx_buf)
-			*bs->rx_buf++ = byte;
-	}
-}
-
-static inline void bcm2708_wr_fifo(struct bcm2708_spi *bs, int len)
-{
-	u8 byte;
-	u16 val;
-
-	if (len > bs->len)
-		len = bs->len;
-
-	if (unlikely(bcm2708_rd(bs, SPI_CS) & SPI_CS_LEN)) {
-		/* LoSSI mode */
-		if (unlikely(len % 2)) {
-			printk(KERN_ERR"bcm2708_wr_fifo: length must be even, skipping.\n");
-			bs->len = 0;
-			return;
-		}
-		while (len) {
-			if (bs->tx_buf) {
-				val = *(const u16 *)bs->tx_buf;
-				bs->tx_buf += 2;
-			} else
-				val = 0;
-			bcm2708_wr(bs, SPI_FIFO, val);
-			bs->len -= 2;
-			len -= 2;
-		}
-		return;
-	}
-
-	while (len--) {
-		byte = bs->tx_buf ? *bs->tx_buf++ : 0;
-		bcm2708_wr(bs, SPI_FIFO, byte);
-		bs->len--;
-	}
+	bcm2835_engine_wr(&bs->eng, reg, val);
 }
 
 static irqreturn_t bcm2708_spi_interrupt(int irq, void *dev_id)
@@ -193,32 +114,26 @@ static irqreturn_t bcm2708_spi_interrupt(int irq, void *dev_id)
 
 	spin_lock(&bs->lock);
 
-	cs = bcm2708_rd(bs, SPI_CS);
+	bcm2835_engine_rd_fifo(&bs->eng);
+	bcm2835_engine_wr_fifo(&bs->eng);
 
-	if (cs & SPI_CS_DONE) {
-		if (bs->len) { /* first interrupt in a transfer */
-			/* fill the TX fifo with up to 16 bytes */
-			bcm2708_wr_fifo(bs, 16);
-		} else { /* transfer complete */
+	/*
+	 * once everything is in the tx fifo more than the rx fifo has
+	 * room for may still come in - so RXR stays enabled until DONE
+	 */
+	if (!bs->eng.len) {
+		cs = bcm2708_rd(bs, BCM2835_SPI_CS);
+		if (cs & BCM2835_SPI_CS_DONE) {
 			/* disable interrupts */
-			cs &= ~(SPI_CS_INTR | SPI_CS_INTD);
-			bcm2708_wr(bs, SPI_CS, cs);
+			cs &= ~(BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
+			bcm2708_wr(bs, BCM2835_SPI_CS, cs);
 
 			/* drain RX FIFO */
-			while (cs & SPI_CS_RXD) {
-				bcm2708_rd_fifo(bs, 1);
-				cs = bcm2708_rd(bs, SPI_CS);
-			}
+			bcm2835_engine_rd_fifo(&bs->eng);
 
 			/* wake up our bh */
 			complete(&bs->done);
 		}
-	} else if (cs & SPI_CS_RXR) {
-		/* read 12 bytes of data */
-		bcm2708_rd_fifo(bs, 12);
-
-		/* write up to 12 bytes */
-		bcm2708_wr_fifo(bs, 12);
 	}
 
 	spin_unlock(&bs->lock);
@@ -232,40 +147,25 @@ static int bcm2708_setup_state(struct spi_master *master,
 		u32 hz, u8 csel, u8 mode, u8 bpw)
 {
 	struct bcm2708_spi *bs = spi_master_get_devdata(master);
-	int cdiv;
+	unsigned long cdiv;
 	unsigned long bus_hz;
 	u32 cs = 0;
 
 	bus_hz = clk_get_rate(bs->clk);
 
-	if (hz >= bus_hz) {
-		cdiv = 2; /* bus_hz / 2 is as fast as we can go */
-	} else if (hz) {
-		cdiv = DIV_ROUND_UP(bus_hz, hz);
-
-		/* CDIV must be a power of 2, so round up */
-		cdiv = roundup_pow_of_two(cdiv);
-
-		if (cdiv > 65536) {
-			dev_dbg(dev,
-				"setup: %d Hz too slow, cdiv %u; min %ld Hz\n",
-				hz, cdiv, bus_hz / 65536);
-			return -EINVAL;
-		} else if (cdiv == 65536) {
-			cdiv = 0;
-		} else if (cdiv == 1) {
-			cdiv = 2; /* 1 gets rounded down to 0; == 65536 */
-		}
-	} else {
-		cdiv = 0;
+	if (hz && (DIV_ROUND_UP(bus_hz, hz) > 65536)) {
+		dev_dbg(dev, "setup: %d Hz too slow; min %ld Hz\n",
+			hz, bus_hz / 65536);
+		return -EINVAL;
 	}
+	cdiv = bcm2835_engine_cdiv(bus_hz, hz, 0);
 
 	switch (bpw) {
 	case 8:
 		break;
 	case 9:
 		/* Reading in LoSSI mode is a special case. See 'BCM2835 ARM Peripherals' datasheet */
-		cs |= SPI_CS_LEN;
+		cs |= BCM2835_SPI_CS_LEN;
 		break;
 	default:
 		dev_dbg(dev, "setup: invalid bits_per_word %u (must be 8 or 9)\n",
@@ -274,28 +174,30 @@ static int bcm2708_setup_state(struct spi_master *master,
 	}
 
 	if (mode & SPI_CPOL)
-		cs |= SPI_CS_CPOL;
+		cs |= BCM2835_SPI_CS_CPOL;
 	if (mode & SPI_CPHA)
-		cs |= SPI_CS_CPHA;
+		cs |= BCM2835_SPI_CS_CPHA;
 
 	if (!(mode & SPI_NO_CS)) {
 		if (mode & SPI_CS_HIGH) {
-			cs |= SPI_CS_CSPOL;
-			cs |= SPI_CS_CSPOL0 << csel;
+			cs |= BCM2835_SPI_CS_CSPOL;
+			cs |= BCM2835_SPI_CS_CSPOL0 << csel;
 		}
 
 		cs |= csel;
 	} else {
-		cs |= SPI_CS_CS_10 | SPI_CS_CS_01;
+		cs |= BCM2835_SPI_CS_CS_10 | BCM2835_SPI_CS_CS_01;
 	}
 
 	if (state) {
 		state->cs = cs;
 		state->cdiv = cdiv;
+		state->bits_per_word = bpw;
 		dev_dbg(dev, "setup: want %d Hz; "
-			"bus_hz=%lu / cdiv=%u == %lu Hz; "
+			"bus_hz=%lu / cdiv=%lu == %u Hz; "
 			"mode %u: cs 0x%08X\n",
-			hz, bus_hz, cdiv, bus_hz/cdiv, mode, cs);
+			hz, bus_hz, cdiv, bcm2835_engine_speed(bus_hz, cdiv),
+			mode, cs);
 	}
 
 	return 0;
@@ -306,6 +208,7 @@ static int bcm2708_process_transfer(struct bcm2708_spi *bs,
 {
 	struct spi_device *spi = msg->spi;
 	struct bcm2708_spi_state state, *stp;
+	u64 xfer_ns;
 	int ret;
 	u32 cs;
 
@@ -327,29 +230,44 @@ static int bcm2708_process_transfer(struct bcm2708_spi *bs,
 	}
 
 	reinit_completion(&bs->done);
-	bs->tx_buf = xfer->tx_buf;
-	bs->rx_buf = xfer->rx_buf;
-	bs->len = xfer->len;
-
-        /* start SPI */
-        bcm2708_wr(bs, SPI_CLK, stp->cdiv);
-        cs = stp->cs | SPI_CS_INTR | SPI_CS_TA;
-        bcm2708_wr(bs, SPI_CS, cs);
-
-        /* fill the TX fifo with up to 16 bytes */
-        bcm2708_wr_fifo(bs, 16);
-
-        /* enable interrupts */
-        cs = stp->cs | SPI_CS_INTR | SPI_CS_INTD | SPI_CS_TA;
-        bcm2708_wr(bs, SPI_CS, cs);
+	bcm2835_engine_setup(&bs->eng, xfer->tx_buf, xfer->rx_buf, xfer->len,
+			     stp->bits_per_word);
+	xfer_ns = bcm2835_engine_xfer_time_ns(bs->clk_hz, stp->cdiv,
+					      xfer->len);
+
+        /* start SPI - without interrupts while we fill the fifo */
+        bcm2708_wr(bs, BCM2835_SPI_CLK, stp->cdiv);
+        cs = stp->cs | BCM2835_SPI_CS_TA;
+        bcm2708_wr(bs, BCM2835_SPI_CS, cs);
+	bs->eng.deadline_ns = ktime_get_ns() + xfer_ns +
+		(u64)SPI_TIMEOUT_MS * NSEC_PER_MSEC;
+
+        /* fill the TX fifo as far as it goes */
+        bcm2835_engine_wr_fifo(&bs->eng);
+
+	if (bcm2835_engine_may_poll(&bs->eng, xfer_ns)) {
+		/* short transfers are done before an interrupt would be */
+		ret = bcm2835_engine_poll(&bs->eng);
+	} else {
+		/* enable interrupts */
+		bcm2708_wr(bs, BCM2835_SPI_CS,
+			   cs | BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
 
-	debug_set_high2();
-	ret = wait_for_completion_timeout(&bs->done,
-			msecs_to_jiffies(SPI_TIMEOUT_MS));
-	debug_set_low2();
-	if (ret == 0) {
+		debug_set_high2();
+		ret = wait_for_completion_timeout(&bs->done,
+				msecs_to_jiffies(SPI_TIMEOUT_MS) +
+				usecs_to_jiffies(div_u64(xfer_ns,
+							 NSEC_PER_USEC)));
+		debug_set_low2();
+		ret = ret ? 0 : -ETIMEDOUT;
+	}
+	if (ret) {
 		dev_err(&spi->dev, "transfer timed out\n");
-		return -ETIMEDOUT;
+		/* stop the block and drop what is left in the fifos */
+		bcm2708_wr(bs, BCM2835_SPI_CS, stp->cs
+			   | BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX);
+		synchronize_irq(bs->irq);
+		return ret;
 	}
 
 	if (xfer->delay_usecs) {
@@ -361,10 +279,10 @@ static int bcm2708_process_transfer(struct bcm2708_spi *bs,
 	if (list_is_last(&xfer->transfer_list, &msg->transfers) ||
 			xfer->cs_change) {
 		/* clear TA and interrupt flags */
-		bcm2708_wr(bs, SPI_CS, stp->cs);
+		bcm2708_wr(bs, BCM2835_SPI_CS, stp->cs);
 	}
 
-	msg->actual_length += (xfer->len - bs->len);
+	msg->actual_length += (xfer->len - bs->eng.len);
 
 	return 0;
 }
@@ -461,6 +379,13 @@ static int bcm2708_spi_transfer(struct spi_device *spi, struct spi_message *msg)
 			return -EINVAL;
 		}
 
+		/* LoSSI words are 16 bit in memory */
+		if (((xfer->bits_per_word ? xfer->bits_per_word :
+		      spi->bits_per_word) == 9) && (xfer->len % 2)) {
+			dev_dbg(&spi->dev, "odd length in LoSSI mode\n");
+			return -EINVAL;
+		}
+
 		if (!xfer->bits_per_word || xfer->speed_hz)
 			continue;
 
@@ -548,8 +473,8 @@ static int bcm2708_spi_probe(struct platform_device *pdev)
 	init_completion(&bs->done);
 	INIT_WORK(&bs->work, bcm2708_work);
 
-	bs->base = ioremap(regs->start, resource_size(regs));
-	if (!bs->base) {
+	bs->eng.regs = ioremap(regs->start, resource_size(regs));
+	if (!bs->eng.regs) {
 		dev_err(&pdev->dev, "could not remap memory\n");
 		goto out_master_put;
 	}
@@ -562,6 +487,7 @@ static int bcm2708_spi_probe(struct platform_device *pdev)
 
 	bs->irq = irq;
 	bs->clk = clk;
+	bs->clk_hz = clk_get_rate(clk);
 	bs->stopping = false;
 
 	err = request_irq(irq, bcm2708_spi_interrupt, 0, dev_name(&pdev->dev),
@@ -573,7 +499,7 @@ static int bcm2708_spi_probe(struct platform_device *pdev)
 
 	/* initialise the hardware */
 	clk_prepare_enable(clk);
-	bcm2708_wr(bs, SPI_CS, SPI_CS_REN | SPI_CS_CLEAR_RX | SPI_CS_CLEAR_TX);
+	bcm2708_wr(bs, BCM2835_SPI_CS, BCM2835_SPI_CS_REN | BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX);
 
 	err = spi_register_master(master);
 	if (err) {
@@ -592,7 +518,7 @@ out_free_irq:
 out_workqueue:
 	destroy_workqueue(bs->workq);
 out_iounmap:
-	iounmap(bs->base);
+	iounmap(bs->eng.regs);
 out_master_put:
 	spi_master_put(master);
 out_clk_put:
@@ -608,7 +534,7 @@ static int bcm2708_spi_remove(struct platform_device *pdev)
 	/* reset the hardware and block queue progress */
 	spin_lock_irq(&bs->lock);
 	bs->stopping = true;
-	bcm2708_wr(bs, SPI_CS, SPI_CS_CLEAR_RX | SPI_CS_CLEAR_TX);
+	bcm2708_wr(bs, BCM2835_SPI_CS, BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX);
 	spin_unlock_irq(&bs->lock);
 
 	flush_work(&bs->work);
@@ -616,7 +542,7 @@ static int bcm2708_spi_remove(struct platform_device *pdev)
 	clk_disable_unprepare(bs->clk);
 	clk_put(bs->clk);
 	free_irq(bs->irq, master);
-	iounmap(bs->base);
+	iounmap(bs->eng.regs);
 
 	spi_unregister_master(master);
 
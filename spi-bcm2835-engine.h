@@ -0,0 +1,432 @@
+/*
+ * The FIFO engine of the Broadcom BCM2835 SPI block
+ *
+ * shared between spi-bcm2708 and spi-bcm2835 - everything is inline,
+ * so the fast paths get compiled into each driver without a call
+ * across modules
+ *
+ * Copyright (C) 2015 Martin Sperl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __SPI_BCM2835_ENGINE_H
+#define __SPI_BCM2835_ENGINE_H
+
+#include <linux/errno.h>
+#include <linux/io.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/types.h>
+
+/* SPI register offsets */
+#define BCM2835_SPI_CS			0x00
+#define BCM2835_SPI_FIFO		0x04
+#define BCM2835_SPI_CLK			0x08
+/*
+ * DLEN (16 bits) only counts the bytes of DMA transfers - the fifo
+ * gets fed by the cpu here, which keeps TA set for as long as there
+ * is data, so transfers are not limited to 65535 bytes
+ */
+#define BCM2835_SPI_DLEN		0x0c
+#define BCM2835_SPI_LTOH		0x10
+#define BCM2835_SPI_DC			0x14
+
+/* Bitfields in CS */
+#define BCM2835_SPI_CS_LEN_LONG		0x02000000
+#define BCM2835_SPI_CS_DMA_LEN		0x01000000
+#define BCM2835_SPI_CS_CSPOL2		0x00800000
+#define BCM2835_SPI_CS_CSPOL1		0x00400000
+#define BCM2835_SPI_CS_CSPOL0		0x00200000
+#define BCM2835_SPI_CS_RXF		0x00100000
+#define BCM2835_SPI_CS_RXR		0x00080000
+#define BCM2835_SPI_CS_TXD		0x00040000
+#define BCM2835_SPI_CS_RXD		0x00020000
+#define BCM2835_SPI_CS_DONE		0x00010000
+#define BCM2835_SPI_CS_LEN		0x00002000
+#define BCM2835_SPI_CS_REN		0x00001000
+#define BCM2835_SPI_CS_ADCS		0x00000800
+#define BCM2835_SPI_CS_INTR		0x00000400
+#define BCM2835_SPI_CS_INTD		0x00000200
+#define BCM2835_SPI_CS_DMAEN		0x00000100
+#define BCM2835_SPI_CS_TA		0x00000080
+#define BCM2835_SPI_CS_CSPOL		0x00000040
+#define BCM2835_SPI_CS_CLEAR_RX		0x00000020
+#define BCM2835_SPI_CS_CLEAR_TX		0x00000010
+#define BCM2835_SPI_CS_CPOL		0x00000008
+#define BCM2835_SPI_CS_CPHA		0x00000004
+#define BCM2835_SPI_CS_CS_10		0x00000002
+#define BCM2835_SPI_CS_CS_01		0x00000001
+
+#define BCM2835_SPI_FIFO_SIZE	64
+
+/* transfers shorter than this get polled instead of using interrupts */
+#define BCM2835_SPI_POLLTIME_US 20
+
+struct bcm2835_spi_engine;
+
+/**
+ * struct bcm2835_spi_engine_ops - what the drivers do differently
+ * @done: called once a transfer has been seen leaving the wire
+ * @turnaround: continue with another phase without dropping TA,
+ *	returns true if there was one
+ *
+ * both are optional
+ */
+struct bcm2835_spi_engine_ops {
+	void (*done)(struct bcm2835_spi_engine *eng);
+	bool (*turnaround)(struct bcm2835_spi_engine *eng);
+};
+
+/**
+ * struct bcm2835_spi_engine - the state of the transfer in the fifo
+ * @regs: the mapped registers
+ * @ops: the driver specific parts
+ * @tx_buf: the next bytes to write - NULL to clock out zeros
+ * @rx_buf: where the next bytes go - NULL to drop them
+ * @len: the bytes left to write to the fifo
+ * @rx_start: where @rx_buf started
+ * @rx_len: the bytes that go to @rx_buf in total
+ * @rx_skip: bytes to drop before storing to @rx_buf
+ * @bits_per_word: of the transfer
+ * @wire_bytes: the bytes per word on the wire
+ * @mem_bytes: the bytes per word in memory
+ * @tx_left: the bytes of @tx_word still to write
+ * @rx_got: the bytes of @rx_word read so far
+ * @tx_word: the word being written - MSB first
+ * @rx_word: the word being read
+ * @deadline_ns: when the transfer is considered stalled
+ * @done_seen_ns: when DONE was last seen clear
+ */
+struct bcm2835_spi_engine {
+	void __iomem *regs;
+	const struct bcm2835_spi_engine_ops *ops;
+	const u8 *tx_buf;
+	u8 *rx_buf;
+	int len;
+	u8 *rx_start;
+	int rx_len;
+	u32 rx_skip;
+	u8 bits_per_word;
+	u8 wire_bytes;
+	u8 mem_bytes;
+	u8 tx_left;
+	u8 rx_got;
+	u32 tx_word;
+	u32 rx_word;
+	u64 deadline_ns;
+	u64 done_seen_ns;
+};
+
+static inline u32 bcm2835_engine_rd(struct bcm2835_spi_engine *eng,
+		unsigned reg)
+{
+	return readl(eng->regs + reg);
+}
+
+static inline void bcm2835_engine_wr(struct bcm2835_spi_engine *eng,
+		unsigned reg, u32 val)
+{
+	writel(val, eng->regs + reg);
+}
+
+/* sets up the engine for the next transfer */
+static inline void bcm2835_engine_setup(struct bcm2835_spi_engine *eng,
+		const void *tx_buf, void *rx_buf, int len, u8 bits_per_word)
+{
+	eng->tx_buf = tx_buf;
+	eng->rx_buf = rx_buf;
+	eng->len = len;
+	eng->rx_start = rx_buf;
+	eng->rx_len = len;
+	eng->rx_skip = 0;
+	eng->bits_per_word = bits_per_word;
+	eng->wire_bytes = DIV_ROUND_UP(bits_per_word, 8);
+	eng->mem_bytes = roundup_pow_of_two(eng->wire_bytes);
+	eng->tx_left = 0;
+	eng->rx_got = 0;
+	eng->rx_word = 0;
+}
+
+/*
+ * words wider than 9 bits are kept in native endianness in memory
+ * (u16 for 16 bit, u32 for 24/32 bit) but need to go over the wire
+ * MSB first one byte at a time - so each word gets loaded once,
+ * left aligned and then shifted out byte by byte
+ */
+static inline void bcm2835_engine_rd_fifo_words(struct bcm2835_spi_engine *eng)
+{
+	while (bcm2835_engine_rd(eng, BCM2835_SPI_CS) & BCM2835_SPI_CS_RXD) {
+		eng->rx_word = (eng->rx_word << 8) |
+			(bcm2835_engine_rd(eng, BCM2835_SPI_FIFO) & 0xff);
+		if (++eng->rx_got < eng->wire_bytes)
+			continue;
+
+		if (eng->mem_bytes == 2)
+			*(u16 *)eng->rx_buf = eng->rx_word;
+		else
+			*(u32 *)eng->rx_buf = eng->rx_word;
+		eng->rx_buf += eng->mem_bytes;
+		eng->rx_got = 0;
+		eng->rx_word = 0;
+	}
+}
+
+static inline void bcm2835_engine_wr_fifo_words(struct bcm2835_spi_engine *eng)
+{
+	while ( (eng->len)
+		&& (bcm2835_engine_rd(eng, BCM2835_SPI_CS) & BCM2835_SPI_CS_TXD)
+		) {
+		if (!eng->tx_left) {
+			eng->tx_word = 0;
+			if (eng->tx_buf) {
+				if (eng->mem_bytes == 2)
+					eng->tx_word = *(const u16 *)eng->tx_buf;
+				else
+					eng->tx_word = *(const u32 *)eng->tx_buf;
+				eng->tx_word <<= 32 - eng->bits_per_word;
+				eng->tx_buf += eng->mem_bytes;
+			}
+			eng->tx_left = eng->wire_bytes;
+		}
+
+		bcm2835_engine_wr(eng, BCM2835_SPI_FIFO, eng->tx_word >> 24);
+		eng->tx_word <<= 8;
+
+		/* the word only counts as written once it is complete */
+		if (!--eng->tx_left)
+			eng->len -= eng->mem_bytes;
+	}
+}
+
+/*
+ * LoSSI: each fifo entry is one 9 bit word - bit 8 tags data (1) or
+ * a command (0) - kept in a u16 in memory like any 9 bit word
+ */
+static inline void bcm2835_engine_rd_fifo_lossi(struct bcm2835_spi_engine *eng)
+{
+	while (bcm2835_engine_rd(eng, BCM2835_SPI_CS) & BCM2835_SPI_CS_RXD) {
+		*(u16 *)eng->rx_buf =
+			bcm2835_engine_rd(eng, BCM2835_SPI_FIFO) & 0x1ff;
+		eng->rx_buf += 2;
+	}
+}
+
+static inline void bcm2835_engine_wr_fifo_lossi(struct bcm2835_spi_engine *eng)
+{
+	const u16 *buf = (const u16 *)eng->tx_buf;
+
+	while ( (eng->len)
+		&& (bcm2835_engine_rd(eng, BCM2835_SPI_CS) & BCM2835_SPI_CS_TXD)
+		) {
+		bcm2835_engine_wr(eng, BCM2835_SPI_FIFO, buf ? *buf++ : 0);
+		eng->len -= 2;
+	}
+
+	if (buf)
+		eng->tx_buf = (const u8 *)buf;
+}
+
+/*
+ * nobody wants the rx data, so drop the whole fifo in one go
+ * instead of reading it byte by byte
+ */
+static inline void bcm2835_engine_rd_fifo_discard(
+		struct bcm2835_spi_engine *eng)
+{
+	u32 cs = bcm2835_engine_rd(eng, BCM2835_SPI_CS);
+
+	if (cs & BCM2835_SPI_CS_RXD)
+		bcm2835_engine_wr(eng, BCM2835_SPI_CS,
+				  cs | BCM2835_SPI_CS_CLEAR_RX);
+}
+
+static inline void bcm2835_engine_rd_fifo(struct bcm2835_spi_engine *eng)
+{
+	if (!eng->rx_buf)
+		return bcm2835_engine_rd_fifo_discard(eng);
+	if (eng->bits_per_word > 9)
+		return bcm2835_engine_rd_fifo_words(eng);
+	if (eng->bits_per_word == 9)
+		return bcm2835_engine_rd_fifo_lossi(eng);
+
+	/* what got clocked in while a flash read header went out */
+	while ((eng->rx_skip) &&
+	       (bcm2835_engine_rd(eng, BCM2835_SPI_CS) & BCM2835_SPI_CS_RXD)) {
+		bcm2835_engine_rd(eng, BCM2835_SPI_FIFO);
+		eng->rx_skip--;
+	}
+
+	while (bcm2835_engine_rd(eng, BCM2835_SPI_CS) & BCM2835_SPI_CS_RXD)
+		*eng->rx_buf++ = bcm2835_engine_rd(eng, BCM2835_SPI_FIFO);
+}
+
+/*
+ * rx-only: every byte written but not yet read back (including a flash
+ * read header) may still sit in the tx fifo - the rest of the fifo is
+ * free, so it can be filled with zeros without checking TXD each time
+ */
+static inline void bcm2835_engine_wr_fifo_zeros(struct bcm2835_spi_engine *eng)
+{
+	int room = BCM2835_SPI_FIFO_SIZE - eng->rx_skip -
+		((eng->rx_len - eng->len) - (int)(eng->rx_buf - eng->rx_start));
+
+	room = min(room, eng->len);
+	if (room <= 0)
+		return;
+
+	eng->len -= room;
+	while (room--)
+		bcm2835_engine_wr(eng, BCM2835_SPI_FIFO, 0);
+}
+
+static inline void bcm2835_engine_wr_fifo(struct bcm2835_spi_engine *eng)
+{
+	u32 val;
+
+	if (eng->bits_per_word > 9)
+		return bcm2835_engine_wr_fifo_words(eng);
+	if (eng->bits_per_word == 9)
+		return bcm2835_engine_wr_fifo_lossi(eng);
+	if ((!eng->tx_buf) && (eng->rx_buf))
+		return bcm2835_engine_wr_fifo_zeros(eng);
+
+	while ( (eng->len)
+		&& (bcm2835_engine_rd(eng, BCM2835_SPI_CS) & BCM2835_SPI_CS_TXD)
+		) {
+		val = 0;
+		if (eng->tx_buf) {
+			val = *eng->tx_buf++;
+		}
+		eng->len--;
+		bcm2835_engine_wr(eng, BCM2835_SPI_FIFO, val);
+	}
+}
+
+/*
+ * the clock divider for spi_hz - optionally one step faster if that is
+ * closer and the device tolerates it
+ */
+static inline unsigned long bcm2835_engine_cdiv(unsigned long clk_hz,
+		unsigned long spi_hz, u32 tolerance_ppm)
+{
+	unsigned long cdiv, slow_hz, fast_hz;
+
+	if (spi_hz >= clk_hz / 2) {
+		cdiv = 2; /* clk_hz/2 is the fastest we can go */
+	} else if (spi_hz) {
+		cdiv = DIV_ROUND_UP(clk_hz, spi_hz);
+		/* make the divider "even" by rounding up
+		 * this ensures that the phases are of equal length
+		 */
+		cdiv += (cdiv % 2) ;
+
+		if (cdiv >= 65536)
+			cdiv = 0; /* 0 is the slowest we can go */
+	} else
+		cdiv = 0; /* 0 is the slowest we can go */
+
+	if ((tolerance_ppm) && (cdiv > 2)) {
+		slow_hz = clk_hz / cdiv;
+		fast_hz = clk_hz / (cdiv - 2);
+		if ((fast_hz <= spi_hz + mult_frac(spi_hz, tolerance_ppm,
+						   1000000)) &&
+		    (fast_hz - spi_hz < spi_hz - slow_hz))
+			cdiv -= 2;
+	}
+
+	return cdiv;
+}
+
+static inline u32 bcm2835_engine_speed(unsigned long clk_hz,
+		unsigned long cdiv)
+{
+	return clk_hz / (cdiv ? cdiv : 65536);
+}
+
+/* the expected time on the wire - 8 bits and 1 idle clock per byte */
+static inline u64 bcm2835_engine_xfer_time_ns(unsigned long clk_hz,
+		unsigned long cdiv, u32 len)
+{
+	/* CDIV 0 is the slowest divider: 65536 */
+	u64 cycles = (u64)len * 9 * (cdiv ? cdiv : 65536);
+	u32 rem;
+	u64 ns;
+
+	if (!clk_hz)
+		return 0;
+
+	ns = div_u64_rem(cycles, clk_hz, &rem) * NSEC_PER_SEC;
+
+	return ns + div_u64((u64)rem * NSEC_PER_SEC, clk_hz);
+}
+
+/*
+ * once the whole transfer is in the fifo, a short one is cheaper to
+ * busy-wait for than an interrupt and the wakeup of the waiting thread
+ */
+static inline bool bcm2835_engine_may_poll(struct bcm2835_spi_engine *eng,
+		u64 xfer_ns)
+{
+	return (!eng->len) && (xfer_ns <= BCM2835_SPI_POLLTIME_US * NSEC_PER_USEC);
+}
+
+/*
+ * busy-waits for the transfer to leave the wire - the tx fifo and the
+ * shifter may still hold more than the rx fifo has room for, so it
+ * needs to be drained until DONE or the clock stops on a full rx fifo
+ */
+static inline int bcm2835_engine_wait_done(struct bcm2835_spi_engine *eng)
+{
+	while (!(bcm2835_engine_rd(eng, BCM2835_SPI_CS) &
+		 BCM2835_SPI_CS_DONE)) {
+		bcm2835_engine_rd_fifo(eng);
+		eng->done_seen_ns = ktime_get_ns();
+		if (eng->done_seen_ns > eng->deadline_ns)
+			return -ETIMEDOUT;
+	}
+	if (eng->ops && eng->ops->done)
+		eng->ops->done(eng);
+
+	return 0;
+}
+
+/* services the fifo until the transfer and any further phase are done */
+static inline int bcm2835_engine_poll(struct bcm2835_spi_engine *eng)
+{
+	int len, err;
+
+	do {
+		while (eng->len) {
+			len = eng->len;
+			bcm2835_engine_rd_fifo(eng);
+			bcm2835_engine_wr_fifo(eng);
+			/* only look at the clock when we are not progressing */
+			if ((eng->len == len) &&
+			    (ktime_get_ns() > eng->deadline_ns))
+				return -ETIMEDOUT;
+		}
+		err = bcm2835_engine_wait_done(eng);
+		if (err)
+			return err;
+	} while (eng->ops && eng->ops->turnaround &&
+		 eng->ops->turnaround(eng));
+
+	return 0;
+}
+
+#endif /* __SPI_BCM2835_ENGINE_H */
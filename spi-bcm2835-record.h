@@ -0,0 +1,72 @@
+/*
+ * Workload recording format of the Broadcom BCM2835 SPI driver
+ *
+ * shared between the kernel driver and userspace
+ *
+ * Copyright (C) 2015 Martin Sperl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __SPI_BCM2835_RECORD_H
+#define __SPI_BCM2835_RECORD_H
+
+#include <linux/types.h>
+
+/*
+ * Usage:
+ * * echo <buffer bytes> > /sys/bus/platform/devices/<dev>/record
+ *   starts a new recording, 0 stops it again
+ * * /sys/bus/platform/devices/<dev>/workload then contains
+ *   the header followed by data_size bytes of records
+ *
+ * Each message record is followed by its transfer records,
+ * only the shapes of the messages get recorded, not their data.
+ * Messages that do not fit the buffer anymore are counted as dropped.
+ */
+
+#define BCM2835_SPI_REC_MAGIC		0x57495053	/* "SPIW" */
+#define BCM2835_SPI_REC_VERSION		1
+
+struct bcm2835_spi_rec_hdr {
+	__u32 magic;
+	__u16 version;
+	__u16 hdr_size;
+	__u32 clk_hz;
+	__u32 messages;
+	__u32 dropped;
+	__u32 data_size;
+};
+
+struct bcm2835_spi_rec_msg {
+	__u32 delta_us;		/* since the previous message got submitted */
+	__u8 chip_select;
+	__u8 mode;		/* the low 8 bits of spi->mode */
+	__u16 transfers;
+};
+
+#define BCM2835_SPI_REC_F_TX		(1 << 0)
+#define BCM2835_SPI_REC_F_RX		(1 << 1)
+#define BCM2835_SPI_REC_F_CS_CHANGE	(1 << 2)
+
+struct bcm2835_spi_rec_xfer {
+	__u32 len;
+	__u32 speed_hz;
+	__u16 delay_usecs;
+	__u8 bits_per_word;
+	__u8 flags;
+};
+
+#endif /* __SPI_BCM2835_RECORD_H */
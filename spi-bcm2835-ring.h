@@ -0,0 +1,167 @@
+/*
+ * Submission/completion ring and streaming interfaces
+ * of the Broadcom BCM2835 SPI driver
+ *
+ * shared between the kernel driver and userspace
+ *
+ * Copyright (C) 2015 Martin Sperl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __SPI_BCM2835_RING_H
+#define __SPI_BCM2835_RING_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Usage:
+ * * open /dev/spiX-ring
+ * * BCM2835_SPI_RING_IOC_SETUP with the requested sizes
+ *   (entries get rounded up to a power of 2)
+ * * mmap map_size bytes at offset 0
+ * * fill in sqes at sq.tail, then advance sq.tail
+ * * BCM2835_SPI_RING_IOC_ENTER (the doorbell) - returns the number
+ *   of sqes consumed, the kernel advances sq.head
+ * * reap cqes between cq.head and cq.tail, then advance cq.head
+ *   - poll() waits for completions to become available
+ *
+ * All offsets are relative to the start of the mapping,
+ * buffer offsets are relative to the data area.
+ */
+
+/* the sqe is followed by another transfer of the same message */
+#define BCM2835_SPI_RING_F_LINK		(1 << 0)
+
+/* offset marking "no buffer" */
+#define BCM2835_SPI_RING_NO_BUF		(~0U)
+
+struct bcm2835_spi_ring_sqe {
+	__u32 tx_offset;
+	__u32 rx_offset;
+	__u32 len;
+	__u32 speed_hz;
+	__u16 delay_usecs;
+	/*
+	 * of the first sqe of a message - the device must not be bound
+	 * to a kernel driver other than spidev, else the cqe gets -EBUSY
+	 */
+	__u8 chip_select;
+	__u8 cs_change;
+	__u8 bits_per_word;
+	__u8 flags;
+	__u16 pad;
+	/* returned in the cqe of the last sqe of a message */
+	__u64 user_data;
+};
+
+/*
+ * the wire timestamps (CLOCK_MONOTONIC ns) of the message:
+ * SCK started within [start_ns, start_ns + start_err_ns]
+ * and the last transfer ended within [end_ns - end_err_ns, end_ns]
+ * - all 0 if the message did not run
+ */
+struct bcm2835_spi_ring_cqe {
+	__u64 user_data;
+	__s32 status;
+	__u32 actual_length;
+	__u64 start_ns;
+	__u64 end_ns;
+	__u32 start_err_ns;
+	__u32 end_err_ns;
+};
+
+struct bcm2835_spi_ring_idx {
+	__u32 head;
+	__u32 tail;
+};
+
+struct bcm2835_spi_ring_setup {
+	/* in */
+	__u32 sq_entries;
+	__u32 cq_entries;
+	__u32 data_size;
+	/* out */
+	__u32 sq_offset;
+	__u32 cq_offset;
+	__u32 data_offset;
+	__u32 map_size;
+};
+
+/* the ring indices at the start of the mapping */
+struct bcm2835_spi_ring_hdr {
+	struct bcm2835_spi_ring_idx sq;
+	struct bcm2835_spi_ring_idx cq;
+};
+
+#define BCM2835_SPI_RING_IOC_MAGIC	'r'
+#define BCM2835_SPI_RING_IOC_SETUP \
+	_IOWR(BCM2835_SPI_RING_IOC_MAGIC, 1, struct bcm2835_spi_ring_setup)
+#define BCM2835_SPI_RING_IOC_ENTER \
+	_IO(BCM2835_SPI_RING_IOC_MAGIC, 2)
+
+/*
+ * continuous streaming capture via /dev/spiX-stream
+ *
+ * * BCM2835_SPI_STREAM_IOC_SETUP with the frame template
+ * * mmap map_size bytes at offset 0
+ * * BCM2835_SPI_STREAM_IOC_START - the bus is now exclusively ours
+ * * consume frames between consumer and producer, then advance consumer
+ *   - poll() waits for frames to become available
+ *   - frames arriving while the ring is full are dropped and counted
+ * * BCM2835_SPI_STREAM_IOC_STOP (or close) releases the bus again
+ */
+
+/* record a timestamp (CLOCK_MONOTONIC ns) for each frame */
+#define BCM2835_SPI_STREAM_F_TIMESTAMP	(1 << 0)
+/* keep CS asserted between frames */
+#define BCM2835_SPI_STREAM_F_CS_HOLD	(1 << 1)
+
+/* the maximum frame (and tx template) length */
+#define BCM2835_SPI_STREAM_MAX_FRAME	4096
+
+struct bcm2835_spi_stream_setup {
+	/* in */
+	__u64 tx_template;	/* pointer to frame_len bytes, 0 = zeros */
+	__u32 frame_len;
+	__u32 frames;		/* rounded up to a power of 2 */
+	__u32 speed_hz;
+	__u8 chip_select;	/* unbound or spidev, else EBUSY */
+	__u8 pad[3];
+	__u32 flags;
+	/* out */
+	__u32 frame_stride;
+	__u32 timestamp_offset;
+	__u32 data_offset;
+	__u32 map_size;
+};
+
+/* at the start of the mapping */
+struct bcm2835_spi_stream_hdr {
+	__u32 producer;		/* frames captured - written by the kernel */
+	__u32 consumer;		/* frames consumed - written by userspace */
+	__u32 overruns;		/* frames dropped because the ring was full */
+	__u32 frames;
+};
+
+#define BCM2835_SPI_STREAM_IOC_SETUP \
+	_IOWR(BCM2835_SPI_RING_IOC_MAGIC, 16, struct bcm2835_spi_stream_setup)
+#define BCM2835_SPI_STREAM_IOC_START \
+	_IO(BCM2835_SPI_RING_IOC_MAGIC, 17)
+#define BCM2835_SPI_STREAM_IOC_STOP \
+	_IO(BCM2835_SPI_RING_IOC_MAGIC, 18)
+
+#endif /* __SPI_BCM2835_RING_H */
@@ -23,18 +23,41 @@
  * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
  */
 
+#include <linux/bitops.h>
 #include <linux/clk.h>
 #include <linux/completion.h>
+#include <linux/cpumask.h>
 #include <linux/delay.h>
 #include <linux/err.h>
+#include <linux/gpio.h>
+#include <linux/gpio/driver.h>
 #include <linux/interrupt.h>
 #include <linux/io.h>
 #include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
 #include <linux/of.h>
 #include <linux/of_irq.h>
 #include <linux/of_device.h>
+#include <linux/poll.h>
+#include <linux/pm_qos.h>
+#include <linux/pm_runtime.h>
+#include <linux/slab.h>
 #include <linux/spi/spi.h>
+#include <linux/sysfs.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+
+#include "spi-bcm2835.h"
+#include "spi-bcm2835-engine.h"
+#include "spi-bcm2835-ring.h"
+#include "spi-bcm2835-record.h"
 
 /* define some DEBUG pins */
 #include "bcm2835-gpio-debugpin.h"
@@ -42,310 +65,3266 @@ DEFINE_DEBUG_PIN()  /* used to mark "in worker thread"  */
 DEFINE_DEBUG_PIN(2) /* used to mark "waiting on wakeup" */
 DEFINE_DEBUG_PIN(3) /* used to mark "in SPI-interrupt"  */
 
-/* SPI register offsets */
-#define BCM2835_SPI_CS			0x00
-#define BCM2835_SPI_FIFO		0x04
-#define BCM2835_SPI_CLK			0x08
-#define BCM2835_SPI_DLEN		0x0c
-#define BCM2835_SPI_LTOH		0x10
-#define BCM2835_SPI_DC			0x14
-
-/* Bitfields in CS */
-#define BCM2835_SPI_CS_LEN_LONG		0x02000000
-#define BCM2835_SPI_CS_DMA_LEN		0x01000000
-#define BCM2835_SPI_CS_CSPOL2		0x00800000
-#define BCM2835_SPI_CS_CSPOL1		0x00400000
-#define BCM2835_SPI_CS_CSPOL0		0x00200000
-#define BCM2835_SPI_CS_RXF		0x00100000
-#define BCM2835_SPI_CS_RXR		0x00080000
-#define BCM2835_SPI_CS_TXD		0x00040000
-#define BCM2835_SPI_CS_RXD		0x00020000
-#define BCM2835_SPI_CS_DONE		0x00010000
-#define BCM2835_SPI_CS_LEN		0x00002000
-#define BCM2835_SPI_CS_REN		0x00001000
-#define BCM2835_SPI_CS_ADCS		0x00000800
-#define BCM2835_SPI_CS_INTR		0x00000400
-#define BCM2835_SPI_CS_INTD		0x00000200
-#define BCM2835_SPI_CS_DMAEN		0x00000100
-#define BCM2835_SPI_CS_TA		0x00000080
-#define BCM2835_SPI_CS_CSPOL		0x00000040
-#define BCM2835_SPI_CS_CLEAR_RX		0x00000020
-#define BCM2835_SPI_CS_CLEAR_TX		0x00000010
-#define BCM2835_SPI_CS_CPOL		0x00000008
-#define BCM2835_SPI_CS_CPHA		0x00000004
-#define BCM2835_SPI_CS_CS_10		0x00000002
-#define BCM2835_SPI_CS_CS_01		0x00000001
-
-#define BCM2835_SPI_TIMEOUT_MS	30000
-#define BCM2835_SPI_MODE_BITS	(SPI_CPOL | SPI_CPHA | SPI_CS_HIGH \
-				| SPI_NO_CS | SPI_3WIRE)
+#define BCM2835_SPI_NUM_CS	3
+
+/* the LoSSI output hold time in core clock cycles */
+#define BCM2835_SPI_LTOH_DEFAULT	1
+#define BCM2835_SPI_LTOH_MAX		15
+
+/* GPIO set/clear registers used for fast gpio chip-selects */
+#define BCM2835_GPIO_GPSET0	0x1c
+#define BCM2835_GPIO_GPCLR0	0x28
+#define BCM2835_GPIO_NUM	54
+
+#define BCM2835_SPI_MODE_BITS	(SPI_CPOL | SPI_CPHA | SPI_CS_HIGH \
+				| SPI_NO_CS | SPI_3WIRE)
+
+/*
+ * the achievable speeds get listed for all even dividers up to 65536,
+ * in fixed width lines so that any part of the list can be generated
+ */
+#define BCM2835_SPI_SPEED_TABLE_SIZE	32768
+#define BCM2835_SPI_SPEED_LINE_LEN	17
+
+#define DRV_NAME	"spi-bcm2835"
+
+/* the cpu on which to busy-poll the bus instead of using interrupts */
+static int polling_cpu = -1;
+module_param(polling_cpu, int, 0);
+MODULE_PARM_DESC(polling_cpu,
+	"busy-poll the bus from a thread pinned to this cpu (-1 = interrupts)");
+
+/* the time after which a message gets run regardless of its priority */
+#define BCM2835_SPI_STARVATION_MAX_MS	60000
+static unsigned int sched_starvation_ms = 100;
+module_param(sched_starvation_ms, uint, 0644);
+MODULE_PARM_DESC(sched_starvation_ms,
+	"run messages waiting longer than this first (0 = strict priority, max 60000)");
+
+/* split the interrupt handler into a hard-irq and a threaded part */
+static bool threaded_irq;
+module_param(threaded_irq, bool, 0);
+MODULE_PARM_DESC(threaded_irq,
+	"service the fifo from a threaded interrupt handler");
+
+/* the slack on top of the expected duration of a transfer */
+static unsigned int timeout_margin_us = 10000;
+module_param(timeout_margin_us, uint, 0644);
+MODULE_PARM_DESC(timeout_margin_us,
+	"time beyond the expected duration after which a transfer is stalled");
+
+/* the initial autosuspend delay - it adapts to the traffic from there */
+static int autosuspend_ms = 1000;
+module_param(autosuspend_ms, int, 0);
+MODULE_PARM_DESC(autosuspend_ms,
+	"initial idle time before the clock gets gated (-1 = never)");
+
+/* by how much we may exceed the requested speed to get closer to it */
+static unsigned int speed_tolerance_ppm;
+module_param(speed_tolerance_ppm, uint, 0);
+MODULE_PARM_DESC(speed_tolerance_ppm,
+	"default tolerance above the requested speed in ppm (0 = never exceed)");
+
+/* message priority classes - 0 is the most urgent */
+#define BCM2835_SPI_PRIO_CLASSES	4
+#define BCM2835_SPI_PRIO_DEFAULT	2
+
+struct bcm2835_spi_sched_stats {
+	u64 queued;
+	u64 dispatched;
+	u64 starved;
+	u64 max_wait_ns;
+};
+
+/* latency between message submission and start of its processing */
+struct bcm2835_spi_latency {
+	u64 count;
+	u64 sum_ns;
+	u32 min_ns;
+	u32 max_ns;
+};
+
+/*
+ * the idle gaps between messages in log2 buckets of us - bucket b
+ * holds gaps below 2^b us, the counts get halved once they reach
+ * the limit, so old traffic patterns fade out
+ */
+#define BCM2835_SPI_PM_GAP_BUCKETS	32
+#define BCM2835_SPI_PM_GAP_LIMIT	1024
+/* how often the autosuspend delay gets reconsidered */
+#define BCM2835_SPI_PM_UPDATE_MSGS	64
+/* gating has to save this many times the wake-up cost */
+#define BCM2835_SPI_PM_WAKE_FACTOR	100
+#define BCM2835_SPI_PM_MIN_DELAY_MS	1
+#define BCM2835_SPI_PM_MAX_DELAY_MS	10000
+
+/* the wire timestamps of a completed message */
+#define BCM2835_SPI_TS_HISTORY 8
+struct bcm2835_spi_ts_record {
+	struct spi_message *msg;
+	unsigned int count;
+	struct bcm2835_spi_timestamp span;
+	struct bcm2835_spi_timestamp ts[BCM2835_SPI_MAX_TIMESTAMPS];
+};
+
+struct bcm2835_spi {
+	struct spi_master *master;
+	/* the fifo engine - with the registers */
+	struct bcm2835_spi_engine eng;
+	struct clk *clk;
+	/* the core clock - followed on rate changes */
+	unsigned long clk_hz;
+	struct notifier_block clk_nb;
+	u32 effective_speed_hz;
+	int irq;
+	/* threaded interrupt mode and the cpu for it and the message pump */
+	bool irq_threaded;
+	int irq_cpu;
+	struct completion done;
+	/* the LoSSI output hold time last programmed */
+	u32 ltoh;
+	/* if CS is asserted - for the setup time */
+	bool cs_asserted;
+	/* the device whose CS got released last and when */
+	struct spi_device *cs_off_spi;
+	u64 cs_off_ns;
+	/* the rx phase of a 3-wire transfer, run without dropping TA */
+	struct spi_transfer *turn_tfr;
+	/* the data phase of a flash read and the header bytes before it */
+	struct spi_transfer *mem_tfr;
+	u32 mem_hdr_len;
+	spinlock_t cspol_lock;
+	u32 cspol;
+	/* the mapped GPIO block for fast gpio chip-selects */
+	void __iomem *gpio_regs;
+	/* the transfer method of the spi core message queue */
+	int (*queue_transfer)(struct spi_device *spi,
+			struct spi_message *mesg);
+	/* busy-polling mode */
+	bool polling;
+	bool stopping;
+	int polling_cpu;
+	struct task_struct *poll_task;
+	/* the message scheduler */
+	spinlock_t queue_lock;
+	struct list_head prio_queue[BCM2835_SPI_PRIO_CLASSES];
+	struct spi_message *sched_inflight;
+	struct bcm2835_spi_sched_stats sched_stats[BCM2835_SPI_PRIO_CLASSES];
+	u64 sched_preemptions;
+	struct bcm2835_spi_latency start_latency;
+	/* wire timestamps of the current transfer and the last messages */
+	struct bcm2835_spi_timestamp tfr_ts;
+	/* how long to wait for the current transfer and how often we gave up */
+	unsigned long timeout_jiffies;
+	u64 timeouts;
+	spinlock_t ts_lock;
+	struct bcm2835_spi_ts_record ts_hist[BCM2835_SPI_TS_HISTORY];
+	unsigned int ts_next;
+	/* the workload recorder */
+	spinlock_t rec_lock;
+	bool rec_on;
+	u8 *rec_buf;
+	u32 rec_size;
+	u32 rec_used;
+	u32 rec_msgs;
+	u32 rec_dropped;
+	u64 rec_last_ns;
+	/* runtime power management - the gaps are under queue_lock */
+	struct mutex pm_lock;
+	unsigned int pm_pending;
+	u64 pm_idle_since;
+	u32 pm_gaps[BCM2835_SPI_PM_GAP_BUCKETS];
+	u32 pm_gap_count;
+	unsigned int pm_msgs;
+	unsigned int pm_update_msgs;
+	int pm_delay_ms;
+	s32 pm_tolerance_us;
+	u32 pm_wake_ns;
+	u32 pm_wake_max_ns;
+	u64 pm_suspends;
+	u64 pm_resumes;
+	/* the userspace ring interface */
+	struct miscdevice ring_misc;
+	char ring_name[16];
+	/* the streaming capture interface */
+	struct miscdevice stream_misc;
+	char stream_name[16];
+	unsigned long stream_open;
+	struct spi_message *stream_msg;
+	struct bcm2835_spi_stream *stream;
+	/* the open ring and stream files - revoked on remove */
+	struct mutex misc_lock;
+	bool misc_gone;
+	struct list_head rings;
+	struct bcm2835_spi_stream *stream_ctx;
+};
+
+static inline u32 bcm2835_rd(struct bcm2835_spi *bs, unsigned reg)
+{
+	return bcm2835_engine_rd(&bs->eng, reg);
+}
+
+static inline void bcm2835_wr(struct bcm2835_spi *bs, unsigned reg, u32 val)
+{
+	bcm2835_engine_wr(&bs->eng, reg, val);
+}
+
+/* per device state */
+struct bcm2835_spi_dev {
+	/* gpio chip-select - the GPSET/GPCLR registers or NULL for gpiolib */
+	bool cs_gpio;
+	void __iomem *assert_reg;
+	void __iomem *deassert_reg;
+	u32 mask;
+	/* by how much we may exceed the requested speed */
+	u32 speed_tolerance_ppm;
+	/* the scheduling class and the deadline relative to submission */
+	u32 priority;
+	u32 deadline_ns;
+	/* the LoSSI output hold time - in cycles of the clock it is for */
+	u32 lossi_hold_ns;
+	unsigned long ltoh_clk_hz;
+	u32 ltoh;
+	/* CS setup, hold and inactive times in ns */
+	u32 cs_setup_ns;
+	u32 cs_hold_ns;
+	u32 cs_inactive_ns;
+	/* the latency this device tolerates from a gated controller */
+	struct dev_pm_qos_request pm_qos;
+};
+
+static inline void bcm2835_spi_gpio_cs(struct spi_device *spi, bool assert)
+{
+	struct bcm2835_spi_dev *dev = spi->controller_state;
+
+	if ((!dev) || (!dev->cs_gpio))
+		return;
+
+	if (dev->assert_reg)
+		writel(dev->mask, assert ? dev->assert_reg : dev->deassert_reg);
+	else
+		gpio_set_value(spi->cs_gpio,
+			       assert == !!(spi->mode & SPI_CS_HIGH));
+}
+
+/* continuous streaming capture of a repeated frame */
+#define BCM2835_SPI_STREAM_MAX_FRAMES	65536
+#define BCM2835_SPI_STREAM_MAX_DATA	(64 * 1024 * 1024)
+
+/* the largest workload recording buffer */
+#define BCM2835_SPI_REC_MAX_SIZE	(64 * 1024 * 1024)
+
+struct bcm2835_spi_stream {
+	struct bcm2835_spi *bs;
+	struct spi_device *spi;
+	struct mutex lock;
+	wait_queue_head_t wait;
+	/* the message occupying the bus while streaming */
+	struct spi_message msg;
+	struct spi_transfer xfer;
+	struct completion msg_done;
+	struct completion stopped;
+	bool running;
+	bool stop;
+	/* the shared mapping */
+	void *map;
+	size_t map_size;
+	struct bcm2835_spi_stream_hdr *hdr;
+	u64 *timestamps;
+	u8 *data;
+	/* the frame template */
+	u8 tx[BCM2835_SPI_STREAM_MAX_FRAME];
+	/* where a frame goes that finds the ring full */
+	u8 scratch[BCM2835_SPI_STREAM_MAX_FRAME];
+	u32 frame_len;
+	u32 frame_stride;
+	u32 frames;
+	u32 flags;
+	u32 speed_hz;
+	/* engine state */
+	u32 cs;
+	u32 slot;
+	u8 *frame;
+	u32 tx_pos;
+	u32 rx_pos;
+	/* frames completed - captured or dropped */
+	u32 done;
+};
+
+/*
+ * a new frame goes to the next slot if the ring has room for it,
+ * the oldest unread frame must not get overwritten
+ */
+static void bcm2835_spi_stream_frame(struct bcm2835_spi_stream *st)
+{
+	st->rx_pos = 0;
+	st->tx_pos = 0;
+	if (st->slot + 1 - READ_ONCE(st->hdr->consumer) > st->frames)
+		st->frame = st->scratch;
+	else
+		st->frame = st->data +
+			(st->slot & (st->frames - 1)) * st->frame_stride;
+}
+
+/*
+ * run the FIFOs of the stream and start the next frame when done
+ * returns true once the stream has stopped
+ */
+static bool bcm2835_spi_stream_service(struct bcm2835_spi *bs)
+{
+	struct bcm2835_spi_stream *st = bs->stream;
+
+	while ((st->rx_pos < st->frame_len) &&
+	       (bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_RXD))
+		st->frame[st->rx_pos++] = bcm2835_rd(bs, BCM2835_SPI_FIFO);
+
+	while ((st->tx_pos < st->frame_len) &&
+	       (bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_TXD))
+		bcm2835_wr(bs, BCM2835_SPI_FIFO, st->tx[st->tx_pos++]);
+
+	if (st->rx_pos < st->frame_len)
+		return false;
+
+	/* publish the frame - or drop it if userspace is not keeping up */
+	if (st->frame == st->scratch) {
+		st->hdr->overruns++;
+	} else {
+		if (st->flags & BCM2835_SPI_STREAM_F_TIMESTAMP)
+			st->timestamps[st->slot & (st->frames - 1)] =
+				ktime_get_ns();
+		st->slot++;
+		smp_store_release(&st->hdr->producer, st->slot);
+		wake_up_interruptible(&st->wait);
+	}
+	WRITE_ONCE(st->done, st->done + 1);
+
+	if (READ_ONCE(st->stop)) {
+		bcm2835_wr(bs, BCM2835_SPI_CS, st->cs &
+			   ~(BCM2835_SPI_CS_TA | BCM2835_SPI_CS_INTR
+			     | BCM2835_SPI_CS_INTD));
+		bcm2835_spi_gpio_cs(st->spi, false);
+		return true;
+	}
+
+	/* start the next frame - toggling CS unless told otherwise */
+	bcm2835_spi_stream_frame(st);
+	if (!(st->flags & BCM2835_SPI_STREAM_F_CS_HOLD)) {
+		bcm2835_wr(bs, BCM2835_SPI_CS, st->cs & ~BCM2835_SPI_CS_TA);
+		bcm2835_spi_gpio_cs(st->spi, false);
+		bcm2835_spi_gpio_cs(st->spi, true);
+		bcm2835_wr(bs, BCM2835_SPI_CS, st->cs);
+	}
+	while ((st->tx_pos < st->frame_len) &&
+	       (bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_TXD))
+		bcm2835_wr(bs, BCM2835_SPI_FIFO, st->tx[st->tx_pos++]);
+
+	return false;
+}
+
+static void bcm2835_spi_ts_add(struct bcm2835_spi_ts_record *rec,
+		const struct bcm2835_spi_timestamp *ts)
+{
+	if (rec->count < BCM2835_SPI_MAX_TIMESTAMPS)
+		rec->ts[rec->count] = *ts;
+	if (!rec->count) {
+		rec->span.start_ns = ts->start_ns;
+		rec->span.start_err_ns = ts->start_err_ns;
+	}
+	rec->span.end_ns = ts->end_ns;
+	rec->span.end_err_ns = ts->end_err_ns;
+	rec->count++;
+}
+
+static void bcm2835_spi_ts_publish(struct bcm2835_spi *bs,
+		const struct bcm2835_spi_ts_record *rec)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bs->ts_lock, flags);
+	bs->ts_hist[bs->ts_next] = *rec;
+	bs->ts_next = (bs->ts_next + 1) % BCM2835_SPI_TS_HISTORY;
+	spin_unlock_irqrestore(&bs->ts_lock, flags);
+}
+
+/* finds the most recent record of mesg and copies it out */
+static int bcm2835_spi_ts_lookup(struct bcm2835_spi *bs,
+		struct spi_message *mesg, struct bcm2835_spi_ts_record *rec)
+{
+	unsigned long flags;
+	unsigned int i, idx;
+	int err = -ENOENT;
+
+	spin_lock_irqsave(&bs->ts_lock, flags);
+	for (i = 1; i <= BCM2835_SPI_TS_HISTORY; i++) {
+		idx = (bs->ts_next + BCM2835_SPI_TS_HISTORY - i) %
+			BCM2835_SPI_TS_HISTORY;
+		if (bs->ts_hist[idx].msg == mesg) {
+			*rec = bs->ts_hist[idx];
+			err = 0;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&bs->ts_lock, flags);
+
+	return err;
+}
+
+/* drops the records of mesg - before it gets reused for a new message */
+static void bcm2835_spi_ts_forget(struct bcm2835_spi *bs,
+		struct spi_message *mesg)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&bs->ts_lock, flags);
+	for (i = 0; i < BCM2835_SPI_TS_HISTORY; i++)
+		if (bs->ts_hist[i].msg == mesg)
+			bs->ts_hist[i].msg = NULL;
+	spin_unlock_irqrestore(&bs->ts_lock, flags);
+}
+
+/*
+ * DONE was seen clear at eng->done_seen_ns and has just been seen set,
+ * so the last bit left the wire somewhere in between
+ */
+static void bcm2835_spi_stamp_done(struct bcm2835_spi_engine *eng)
+{
+	struct bcm2835_spi *bs = container_of(eng, struct bcm2835_spi, eng);
+	u64 now = ktime_get_ns();
+
+	bs->tfr_ts.end_ns = now;
+	bs->tfr_ts.end_err_ns = now - eng->done_seen_ns;
+}
+
+/*
+ * 3-wire: once the tx phase has left the wire turn the bus around
+ * for the following rx phase, keeping TA (and so CS) asserted
+ * returns false if there is no rx phase to run
+ */
+static bool bcm2835_spi_turnaround(struct bcm2835_spi_engine *eng)
+{
+	struct bcm2835_spi *bs = container_of(eng, struct bcm2835_spi, eng);
+	struct spi_transfer *tfr = bs->turn_tfr;
+	u32 cs;
+
+	if (!tfr)
+		return false;
+	bs->turn_tfr = NULL;
+
+	/* drop what got sampled while we were driving the line */
+	bcm2835_engine_rd_fifo(eng);
+
+	bcm2835_engine_setup(eng, NULL, tfr->rx_buf, tfr->len,
+			     eng->bits_per_word);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	tfr->effective_speed_hz = bs->effective_speed_hz;
+#endif
+
+	cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+	bcm2835_wr(bs, BCM2835_SPI_CS, cs | BCM2835_SPI_CS_REN);
+	bcm2835_engine_wr_fifo(eng);
+
+	return true;
+}
+
+static const struct bcm2835_spi_engine_ops bcm2835_spi_engine_ops = {
+	.done		= bcm2835_spi_stamp_done,
+	.turnaround	= bcm2835_spi_turnaround,
+};
+
+static irqreturn_t bcm2835_spi_interrupt(int irq, void *dev_id)
+{
+	struct spi_master *master = dev_id;
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+	u64 seen;
+	debug_set_high3();
+
+	if (bs->stream) {
+		if (bcm2835_spi_stream_service(bs))
+			complete(&bs->stream->stopped);
+		else if (bs->irq_threaded)
+			bcm2835_wr(bs, BCM2835_SPI_CS, bs->stream->cs);
+		debug_set_low3();
+		return IRQ_HANDLED;
+	}
+
+	/* Read as many bytes of data as possible */
+	bcm2835_engine_rd_fifo(&bs->eng);
+
+	/* Write as many bytes of data as possible */
+	bcm2835_engine_wr_fifo(&bs->eng);
+
+	if (bs->eng.len) {
+		/* unmask what the hard-irq handler has masked */
+		if (bs->irq_threaded)
+			bcm2835_wr(bs, BCM2835_SPI_CS,
+				cs | BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
+		debug_set_low3();
+		return IRQ_HANDLED;
+	}
+
+	/* everything is in the fifo, but may not be on the wire yet */
+	seen = ktime_get_ns();
+	cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+	if (!(cs & BCM2835_SPI_CS_DONE)) {
+		/*
+		 * the tx fifo and the shifter may still hold more than the
+		 * rx fifo has room for - so keep RXR enabled to drain it
+		 * until DONE, otherwise the clock stops on a full rx fifo
+		 */
+		bs->eng.done_seen_ns = seen;
+		if (bs->irq_threaded)
+			bcm2835_wr(bs, BCM2835_SPI_CS,
+				cs | BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
+	} else if (bcm2835_spi_turnaround(&bs->eng)) {
+		/* go on with the rx phase of a 3-wire transfer */
+		bcm2835_wr(bs, BCM2835_SPI_CS, cs | BCM2835_SPI_CS_REN
+			   | BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
+	} else {
+		bcm2835_spi_stamp_done(&bs->eng);
+
+		/* Disable SPI interrupts */
+		cs &= ~(BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
+		bcm2835_wr(bs, BCM2835_SPI_CS, cs);
+
+		/*
+		 * Wake up bcm2835_spi_transfer_one(), which will call
+		 * bcm2835_spi_finish_transfer(), to drain the RX FIFO.
+		 */
+		complete(&bs->done);
+	}
+
+	debug_set_low3();
+	return IRQ_HANDLED;
+}
+
+/*
+ * the hard-irq part in threaded mode only masks the interrupt sources,
+ * the fifo gets serviced by bcm2835_spi_interrupt running as a thread
+ * on the same cpu as the message pump
+ */
+static irqreturn_t bcm2835_spi_interrupt_hard(int irq, void *dev_id)
+{
+	struct spi_master *master = dev_id;
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+
+	if (!(cs & (BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD)))
+		return IRQ_NONE;
+
+	bcm2835_wr(bs, BCM2835_SPI_CS,
+		   cs & ~(BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD));
+
+	return IRQ_WAKE_THREAD;
+}
+
+/* co-locate the interrupt (thread) and the message pump on one cpu */
+static int bcm2835_spi_set_irq_cpu(struct spi_master *master, int cpu)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	const struct cpumask *mask = cpu_possible_mask;
+	int err;
+
+	if (cpu >= 0) {
+		if ((cpu >= nr_cpu_ids) || !cpu_online(cpu))
+			return -EINVAL;
+		mask = cpumask_of(cpu);
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+	err = irq_set_affinity(bs->irq, mask);
+#else
+	/* irq_set_affinity is not exported - the hint also applies it */
+	err = irq_set_affinity_hint(bs->irq, mask);
+#endif
+	if (err)
+		return err;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+	if (master->kworker) {
+		err = set_cpus_allowed_ptr(master->kworker->task, mask);
+		if (err)
+			return err;
+	}
+#else
+	if (master->kworker_task) {
+		err = set_cpus_allowed_ptr(master->kworker_task, mask);
+		if (err)
+			return err;
+	}
+#endif
+
+	bs->irq_cpu = cpu;
+
+	return 0;
+}
+
+static inline u32 bcm2835_spi_tolerance(struct spi_device *spi)
+{
+	struct bcm2835_spi_dev *dev = spi->controller_state;
+
+	return dev ? dev->speed_tolerance_ppm : speed_tolerance_ppm;
+}
+
+/*
+ * the block has no CS timing of its own, so these are busy-waits on
+ * the cpu - subject to interrupts and preemption like any ndelay
+ */
+static inline void bcm2835_spi_cs_delay(u32 ns)
+{
+	if (ns)
+		ndelay(ns);
+}
+
+static inline void bcm2835_spi_cs_released(struct bcm2835_spi *bs,
+		struct spi_device *spi)
+{
+	bs->cs_asserted = false;
+	bs->cs_off_spi = spi;
+	bs->cs_off_ns = ktime_get_ns();
+}
+
+/* what is left of the inactive time - also across messages */
+static inline void bcm2835_spi_cs_inactive(struct bcm2835_spi *bs,
+		struct spi_device *spi)
+{
+	struct bcm2835_spi_dev *dev = spi->controller_state;
+	u64 off_ns;
+
+	if ((!dev) || (!dev->cs_inactive_ns) || (bs->cs_off_spi != spi))
+		return;
+
+	off_ns = ktime_get_ns() - bs->cs_off_ns;
+	if (off_ns < dev->cs_inactive_ns)
+		ndelay(dev->cs_inactive_ns - off_ns);
+}
+
+/* the hold time in cycles - recalculated once the core clock changed */
+static inline u32 bcm2835_spi_dev_ltoh(struct bcm2835_spi_dev *dev,
+		unsigned long clk_hz)
+{
+	if (!dev)
+		return BCM2835_SPI_LTOH_DEFAULT;
+
+	if (dev->ltoh_clk_hz != clk_hz) {
+		dev->ltoh = clamp_t(u64,
+				    DIV_ROUND_UP_ULL((u64)dev->lossi_hold_ns *
+						     clk_hz, NSEC_PER_SEC),
+				    BCM2835_SPI_LTOH_DEFAULT,
+				    BCM2835_SPI_LTOH_MAX);
+		dev->ltoh_clk_hz = clk_hz;
+	}
+
+	return dev->ltoh;
+}
+
+/* LoSSI devices may need more hold time than the default - only if changed */
+static inline void bcm2835_spi_set_ltoh(struct bcm2835_spi *bs,
+		struct spi_device *spi, unsigned long clk_hz)
+{
+	u32 ltoh = bcm2835_spi_dev_ltoh(spi->controller_state, clk_hz);
+
+	if (ltoh == bs->ltoh)
+		return;
+
+	bs->ltoh = ltoh;
+	bcm2835_wr(bs, BCM2835_SPI_LTOH, ltoh);
+}
+
+/* readers take a single snapshot of the clock, so no lock is needed */
+static int bcm2835_spi_clk_notifier(struct notifier_block *nb,
+		unsigned long event, void *data)
+{
+	struct bcm2835_spi *bs = container_of(nb, struct bcm2835_spi, clk_nb);
+	struct clk_notifier_data *ndata = data;
+
+	if (event == POST_RATE_CHANGE)
+		WRITE_ONCE(bs->clk_hz, ndata->new_rate);
+
+	return NOTIFY_OK;
+}
+
+/* the value of the CS register (with TA set) for this transfer */
+static u32 bcm2835_spi_cs(struct spi_device *spi, struct spi_transfer *tfr)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_dev *dev = spi->controller_state;
+	u32 cs = BCM2835_SPI_CS_TA;
+	unsigned long flags;
+
+	if (spi->mode & SPI_CPOL)
+		cs |= BCM2835_SPI_CS_CPOL;
+	if (spi->mode & SPI_CPHA)
+		cs |= BCM2835_SPI_CS_CPHA;
+
+	/* gpio chip-selects must not toggle any of the native ones */
+	if ((spi->mode & SPI_NO_CS) || (dev && dev->cs_gpio))
+		cs |= BCM2835_SPI_CS_CS_10 | BCM2835_SPI_CS_CS_01;
+	else
+		cs |= spi->chip_select;
+
+	spin_lock_irqsave(&bs->cspol_lock, flags);
+	cs |= bs->cspol;
+	spin_unlock_irqrestore(&bs->cspol_lock, flags);
+
+	/* LoSSI/9-bit mode */
+	if (tfr->bits_per_word == 9)
+		cs |= BCM2835_SPI_CS_LEN;
+
+	/* 3-WIRE mode */
+	if ( (spi->mode & SPI_3WIRE) && (tfr->rx_buf) )
+		cs |= BCM2835_SPI_CS_REN;
+
+	return cs;
+}
+
+/*
+ * a transfer has missed its deadline: stop the block and drop what is
+ * left in the fifos, so that the next message can go ahead right away
+ */
+static void bcm2835_spi_recover(struct bcm2835_spi *bs)
+{
+	unsigned long flags;
+	u32 cs;
+
+	spin_lock_irqsave(&bs->cspol_lock, flags);
+	cs = BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX | bs->cspol;
+	spin_unlock_irqrestore(&bs->cspol_lock, flags);
+
+	/* clears TA and disables the interrupts */
+	bcm2835_wr(bs, BCM2835_SPI_CS, cs);
+	/* a handler still running may have re-enabled them */
+	if (!bs->polling) {
+		synchronize_irq(bs->irq);
+		bcm2835_wr(bs, BCM2835_SPI_CS, cs);
+	}
+
+	bs->turn_tfr = NULL;
+	bs->timeouts++;
+	dev_warn_ratelimited(&bs->master->dev,
+			     "transfer stalled - fifos reset\n");
+}
+
+/*
+ * serial flash reads: the command, address and dummy bytes - as one or
+ * more short tx-only transfers - followed by an rx-only transfer for
+ * the data run as a single transfer without waiting in between
+ * returns the data transfer and the length of the header before it
+ */
+static struct spi_transfer *bcm2835_spi_mem_tfr(struct spi_device *spi,
+		struct spi_message *mesg, struct spi_transfer *tfr,
+		u32 *hdr_len)
+{
+	struct spi_transfer *next = tfr;
+	u32 len = 0;
+
+	/* 3-wire devices get turned around instead */
+	if (spi->mode & SPI_3WIRE)
+		return NULL;
+
+	while ((next->tx_buf) && (!next->rx_buf)) {
+		len += next->len;
+		if ((len > BCM2835_SPI_FIFO_SIZE) || (next->cs_change) ||
+		    (next->delay_usecs) || (next->bits_per_word != 8) ||
+		    (next->speed_hz != tfr->speed_hz) ||
+		    list_is_last(&next->transfer_list, &mesg->transfers))
+			return NULL;
+		next = list_next_entry(next, transfer_list);
+	}
+
+	if ((next == tfr) || (!next->rx_buf) || (next->tx_buf) ||
+	    (next->speed_hz != tfr->speed_hz) || (next->bits_per_word != 8))
+		return NULL;
+
+	*hdr_len = len;
+
+	return next;
+}
+
+/*
+ * the header fits the empty fifo, so it goes in without looking at TXD
+ * - the data phase then gets clocked with zeros right behind it
+ */
+static void bcm2835_spi_mem_prefill(struct bcm2835_spi *bs,
+		struct spi_transfer *tfr)
+{
+	const u8 *buf;
+	u32 i;
+
+	for (; tfr != bs->mem_tfr; tfr = list_next_entry(tfr, transfer_list))
+		for (i = 0, buf = tfr->tx_buf; i < tfr->len; i++)
+			bcm2835_wr(bs, BCM2835_SPI_FIFO, buf[i]);
+
+	bcm2835_engine_setup(&bs->eng, NULL, bs->mem_tfr->rx_buf,
+			     bs->mem_tfr->len, 8);
+	bs->eng.rx_skip = bs->mem_hdr_len;
+}
+
+static int bcm2835_spi_start_transfer(struct spi_device *spi,
+		struct spi_transfer *tfr)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_dev *dev = spi->controller_state;
+	unsigned long clk_hz, cdiv;
+	u64 xfer_ns;
+	int err;
+	u32 cs;
+
+	clk_hz = READ_ONCE(bs->clk_hz);
+	cdiv = bcm2835_engine_cdiv(clk_hz, tfr->speed_hz,
+				   bcm2835_spi_tolerance(spi));
+	cs = bcm2835_spi_cs(spi, tfr);
+
+	/* report the speed we really use */
+	bs->effective_speed_hz = bcm2835_engine_speed(clk_hz, cdiv);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	tfr->effective_speed_hz = bs->effective_speed_hz;
+#endif
+
+	/* how long this (and a following 3-wire rx phase) should take */
+	if (bs->mem_tfr)
+		xfer_ns = bcm2835_engine_xfer_time_ns(clk_hz, cdiv,
+				bs->mem_hdr_len + bs->mem_tfr->len);
+	else
+		xfer_ns = bcm2835_engine_xfer_time_ns(clk_hz, cdiv, tfr->len +
+				(bs->turn_tfr ? bs->turn_tfr->len : 0));
+	bs->timeout_jiffies = usecs_to_jiffies(min_t(u64, UINT_MAX,
+			div_u64(xfer_ns, NSEC_PER_USEC) + timeout_margin_us)) + 1;
+
+	reinit_completion(&bs->done);
+	bcm2835_engine_setup(&bs->eng, tfr->tx_buf, tfr->rx_buf, tfr->len,
+			     tfr->bits_per_word);
+
+        bcm2835_wr(bs, BCM2835_SPI_CLK, cdiv);
+	if (tfr->bits_per_word == 9)
+		bcm2835_spi_set_ltoh(bs, spi, clk_hz);
+	if (!bs->cs_asserted)
+		bcm2835_spi_cs_inactive(bs, spi);
+        bcm2835_spi_gpio_cs(spi, true);
+        /** Enable the HW block, but without the interrupts enabled,
+         * so that we can fill in some data into the fifo now
+         * and avoid delays doe to interrupt overheads...
+         */
+        bcm2835_wr(bs, BCM2835_SPI_CS, cs);
+	/* CS is asserted, SCK only starts with the first byte in the fifo */
+	if (!bs->cs_asserted) {
+		bs->cs_asserted = true;
+		bcm2835_spi_cs_delay(dev ? dev->cs_setup_ns : 0);
+	}
+	/* SCK starts with the first byte written to the fifo */
+	bs->tfr_ts.start_ns = ktime_get_ns();
+	bs->eng.deadline_ns = bs->tfr_ts.start_ns + xfer_ns +
+		(u64)timeout_margin_us * NSEC_PER_USEC;
+	if (bs->mem_tfr)
+		bcm2835_spi_mem_prefill(bs, tfr);
+        /* Write as many bytes of data as possible */
+        bcm2835_engine_wr_fifo(&bs->eng);
+	bs->eng.done_seen_ns = ktime_get_ns();
+	bs->tfr_ts.start_err_ns = bs->eng.done_seen_ns - bs->tfr_ts.start_ns;
+
+	/* in busy-poll mode never enable interrupts,
+	 * but keep filling and draining the fifo until we are done
+	 */
+	if (bs->polling) {
+		err = bcm2835_engine_poll(&bs->eng);
+		if (err)
+			return err;
+		complete(&bs->done);
+		return 0;
+	}
+
+	/* if the time is bigger than the given BCM2835_SPI_POLLTIME_US
+	 * or we still have bytes to transfer
+	 * then run the interrupt
+	 * note that this still hides the fact that the interrupt+wakeup
+	 * is "expensive" and we should do all transfers in a message
+	 * without waking up the worker thread
+	 */
+	if (!bcm2835_engine_may_poll(&bs->eng, xfer_ns)) {
+		/* and now enable the interrupt for TX-empty*/
+		bcm2835_wr(bs, BCM2835_SPI_CS,
+			cs | BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
+	} else {
+		/* poll until we get there */
+		err = bcm2835_engine_poll(&bs->eng);
+		if (err)
+			return err;
+		/* and set completed */
+		complete(&bs->done);
+	}
+
+	return 0;
+}
+
+/*
+ * runs the stream from the message pump until it gets stopped
+ * - a stream not completing any frame for longer than a frame
+ * and the timeout margin has stalled and gets aborted
+ */
+static int bcm2835_spi_stream_run(struct spi_device *spi,
+		struct spi_transfer *tfr)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_stream *st = bs->stream;
+	unsigned long clk_hz = READ_ONCE(bs->clk_hz);
+	unsigned long cdiv;
+	u64 stall_ns;
+	u64 deadline;
+	u32 done;
+
+	st->cs = bcm2835_spi_cs(spi, tfr);
+	bcm2835_spi_stream_frame(st);
+	reinit_completion(&st->stopped);
+
+	cdiv = bcm2835_engine_cdiv(clk_hz, tfr->speed_hz,
+				   bcm2835_spi_tolerance(spi));
+	stall_ns = bcm2835_engine_xfer_time_ns(clk_hz, cdiv,
+					       st->frame_len) +
+		(u64)timeout_margin_us * NSEC_PER_USEC;
+
+	bcm2835_wr(bs, BCM2835_SPI_CLK, cdiv);
+	bcm2835_spi_gpio_cs(spi, true);
+	bcm2835_wr(bs, BCM2835_SPI_CS, st->cs);
+
+	done = st->done;
+	if (bs->polling) {
+		deadline = ktime_get_ns() + stall_ns;
+		while (!bcm2835_spi_stream_service(bs)) {
+			if (st->done != done) {
+				done = st->done;
+				deadline = ktime_get_ns() + stall_ns;
+			} else if (ktime_get_ns() > deadline) {
+				bcm2835_spi_recover(bs);
+				return -ETIMEDOUT;
+			}
+			cond_resched();
+		}
+		return 0;
+	}
+
+	/* the DONE interrupt fires immediately and fills the FIFO */
+	st->cs |= BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD;
+	bcm2835_wr(bs, BCM2835_SPI_CS, st->cs);
+
+	debug_set_high2();
+	while (!wait_for_completion_timeout(&st->stopped,
+			usecs_to_jiffies(div_u64(stall_ns, NSEC_PER_USEC)) + 1)) {
+		if (READ_ONCE(st->done) == done) {
+			debug_set_low2();
+			bcm2835_spi_recover(bs);
+			return -ETIMEDOUT;
+		}
+		done = READ_ONCE(st->done);
+	}
+	debug_set_low2();
+
+	return 0;
+}
+
+/*
+ * 3-wire: a tx-only transfer directly followed by an rx-only one
+ * (command then response) runs as a single transfer
+ */
+static struct spi_transfer *bcm2835_spi_turnaround_tfr(struct spi_device *spi,
+		struct spi_message *mesg, struct spi_transfer *tfr)
+{
+	struct spi_transfer *next;
+
+	if ((!(spi->mode & SPI_3WIRE)) || (!tfr->tx_buf) || (tfr->rx_buf) ||
+	    (tfr->cs_change) || (tfr->delay_usecs) ||
+	    list_is_last(&tfr->transfer_list, &mesg->transfers))
+		return NULL;
+
+	next = list_next_entry(tfr, transfer_list);
+	if ((!next->rx_buf) || (next->tx_buf) ||
+	    (next->speed_hz != tfr->speed_hz) ||
+	    (next->bits_per_word != tfr->bits_per_word))
+		return NULL;
+
+	return next;
+}
+
+static int bcm2835_spi_finish_transfer(struct spi_device *spi,
+		struct spi_transfer *tfr, bool cs_change)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_dev *dev = spi->controller_state;
+	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+
+	/* Drain RX FIFO */
+	bcm2835_engine_rd_fifo(&bs->eng);
+
+	if (tfr->delay_usecs) {
+		debug_set_high2();
+		udelay(tfr->delay_usecs);
+		debug_set_low2();
+	}
+
+	if (cs_change) {
+		if (dev)
+			bcm2835_spi_cs_delay(dev->cs_hold_ns);
+		/* Clear TA flag */
+		bcm2835_wr(bs, BCM2835_SPI_CS, cs & ~BCM2835_SPI_CS_TA);
+		bcm2835_spi_gpio_cs(spi, false);
+		bcm2835_spi_cs_released(bs, spi);
+	}
+
+	return 0;
+}
+
+/*
+ * the message submission time is kept in mesg->state while we own it:
+ * 32 bits of 64 ns units, so it wraps after ~274s - ages get taken
+ * modulo that and saturate at half of it (see bcm2835_spi_sched_age)
+ */
+#define BCM2835_SPI_STAMP_SHIFT		6
+
+static inline u32 bcm2835_spi_stamp_now(void)
+{
+	return ktime_get_ns() >> BCM2835_SPI_STAMP_SHIFT;
+}
+
+static inline void bcm2835_spi_stamp_message(struct spi_message *mesg)
+{
+	u32 now = bcm2835_spi_stamp_now();
+
+	/* NULL marks a message without a stamp */
+	mesg->state = (void *)(unsigned long)(now ? now : 1);
+}
+
+/* the time since submission - in stamp units */
+static inline u32 bcm2835_spi_sched_age(struct spi_message *mesg, u32 now)
+{
+	u32 age;
+
+	if (!mesg->state)
+		return 0;
+
+	/* stamps are never from the future - so this has wrapped */
+	age = now - (u32)(unsigned long)mesg->state;
+	return (s32)age < 0 ? S32_MAX : age;
+}
+
+static void bcm2835_spi_account_start(struct bcm2835_spi *bs,
+		struct spi_message *mesg)
+{
+	struct bcm2835_spi_latency *lat = &bs->start_latency;
+	u32 delta;
+
+	/* messages submitted before we hooked into the queue */
+	if (!mesg->state)
+		return;
+
+	delta = min_t(u64, (u64)bcm2835_spi_sched_age(mesg,
+			bcm2835_spi_stamp_now()) << BCM2835_SPI_STAMP_SHIFT,
+		      U32_MAX);
+	mesg->state = NULL;
+
+	if ((!lat->count) || (delta < lat->min_ns))
+		lat->min_ns = delta;
+	if (delta > lat->max_ns)
+		lat->max_ns = delta;
+	lat->sum_ns += delta;
+	lat->count++;
+}
+
+/*
+ * priority scheduling of messages
+ *
+ * messages get queued per priority class of their device and the most
+ * urgent one gets run next: the highest class first and within a class
+ * the one with the earliest deadline (submission + device deadline).
+ * Messages that have been waiting for longer than sched_starvation_ms
+ * get run first regardless of their class.
+ */
+
+static inline unsigned int bcm2835_spi_sched_class(struct spi_message *mesg)
+{
+	struct bcm2835_spi_dev *dev = mesg->spi->controller_state;
+
+	return dev ? dev->priority : BCM2835_SPI_PRIO_DEFAULT;
+}
+
+/* the time left until the deadline - in stamp units, negative if missed */
+static inline s64 bcm2835_spi_sched_slack(struct spi_message *mesg, u32 now)
+{
+	struct bcm2835_spi_dev *dev = mesg->spi->controller_state;
+
+	return (s64)((dev ? dev->deadline_ns : 0) >> BCM2835_SPI_STAMP_SHIFT) -
+		bcm2835_spi_sched_age(mesg, now);
+}
+
+static void bcm2835_spi_sched_queue(struct bcm2835_spi *bs,
+		struct spi_message *mesg)
+{
+	unsigned int class = bcm2835_spi_sched_class(mesg);
+
+	list_add_tail(&mesg->queue, &bs->prio_queue[class]);
+	bs->sched_stats[class].queued++;
+}
+
+static void bcm2835_spi_batch_complete(void *context);
+static void bcm2835_spi_poll_complete(void *context);
+
+/*
+ * only plain messages may run in the CS gap of another message - a
+ * stream or a batch/poll carrier would hold it for much longer
+ */
+static inline bool bcm2835_spi_sched_eligible(struct bcm2835_spi *bs,
+		struct spi_message *mesg, bool preempt)
+{
+	return (!preempt) ||
+		((mesg != bs->stream_msg) &&
+		 (mesg->complete != bcm2835_spi_batch_complete) &&
+		 (mesg->complete != bcm2835_spi_poll_complete));
+}
+
+/*
+ * pick the most urgent message of a class better than max_class
+ * - called with queue_lock held
+ */
+static struct spi_message *bcm2835_spi_sched_pick(struct bcm2835_spi *bs,
+		unsigned int max_class, bool preempt)
+{
+	u32 now = bcm2835_spi_stamp_now();
+	u32 starve = ((u64)min_t(unsigned int, sched_starvation_ms,
+				 BCM2835_SPI_STARVATION_MAX_MS) *
+		      NSEC_PER_MSEC) >> BCM2835_SPI_STAMP_SHIFT;
+	struct spi_message *mesg, *best = NULL;
+	unsigned int class, best_class = 0;
+	u32 age, best_age = 0;
+
+	/* first the messages that have been waiting for too long */
+	for (class = 0; (starve) && (class < max_class); class++) {
+		/* the first (eligible) message of a class is its oldest */
+		list_for_each_entry(mesg, &bs->prio_queue[class], queue)
+			if (bcm2835_spi_sched_eligible(bs, mesg, preempt))
+				break;
+		if (&mesg->queue == &bs->prio_queue[class])
+			continue;
+
+		age = bcm2835_spi_sched_age(mesg, now);
+		if (age <= starve)
+			continue;
+
+		if ((!best) || (age > best_age)) {
+			best = mesg;
+			best_age = age;
+			best_class = class;
+		}
+	}
+	if (best) {
+		for (class = 0; class < best_class; class++)
+			if (!list_empty(&bs->prio_queue[class])) {
+				bs->sched_stats[best_class].starved++;
+				break;
+			}
+		goto found;
+	}
+
+	/* then earliest deadline first within the best class */
+	for (class = 0; class < max_class; class++) {
+		list_for_each_entry(mesg, &bs->prio_queue[class], queue) {
+			if (!bcm2835_spi_sched_eligible(bs, mesg, preempt))
+				continue;
+			if ((!best) ||
+			    (bcm2835_spi_sched_slack(mesg, now) <
+			     bcm2835_spi_sched_slack(best, now)))
+				best = mesg;
+		}
+		if (best) {
+			best_class = class;
+			goto found;
+		}
+	}
+
+	return NULL;
+
+found:
+	list_del_init(&best->queue);
+	bs->sched_stats[best_class].dispatched++;
+	age = bcm2835_spi_sched_age(best, now);
+	if (((u64)age << BCM2835_SPI_STAMP_SHIFT) >
+	    bs->sched_stats[best_class].max_wait_ns)
+		bs->sched_stats[best_class].max_wait_ns =
+			(u64)age << BCM2835_SPI_STAMP_SHIFT;
+
+	return best;
+}
+
+static void bcm2835_spi_pm_account_done(struct bcm2835_spi *bs);
+
+/* every message queued to the scheduler gets completed through here */
+static void bcm2835_spi_sched_complete(struct bcm2835_spi *bs,
+		struct spi_message *mesg)
+{
+	bcm2835_spi_pm_account_done(bs);
+	mesg->complete(mesg->context);
+}
+
+/*
+ * hand the most urgent message to the spi core message queue,
+ * keeping only a single message in there so that we decide the order
+ */
+static void bcm2835_spi_sched_dispatch(struct bcm2835_spi *bs,
+		struct spi_message *done)
+{
+	struct spi_message *mesg;
+	unsigned long flags;
+	int err;
+
+	for (;;) {
+		spin_lock_irqsave(&bs->queue_lock, flags);
+		if (done && (bs->sched_inflight == done))
+			bs->sched_inflight = NULL;
+		done = NULL;
+		if (bs->sched_inflight) {
+			spin_unlock_irqrestore(&bs->queue_lock, flags);
+			return;
+		}
+		mesg = bcm2835_spi_sched_pick(bs, BCM2835_SPI_PRIO_CLASSES,
+					      false);
+		bs->sched_inflight = mesg;
+		spin_unlock_irqrestore(&bs->queue_lock, flags);
+
+		if (!mesg)
+			return;
+
+		err = bs->queue_transfer(mesg->spi, mesg);
+		if (!err)
+			return;
+
+		mesg->status = err;
+		bcm2835_spi_sched_complete(bs, mesg);
+		done = mesg;
+	}
+}
+
+static int bcm2835_spi_do_message(struct spi_master *master,
+		struct spi_message *mesg);
+static void bcm2835_spi_batch_run(struct spi_master *master,
+		struct bcm2835_spi_batch *batch);
+static void bcm2835_spi_poll_run(struct spi_master *master,
+		struct bcm2835_spi_poll *poll);
+
+/*
+ * run queued messages of a better class while the current message
+ * has deasserted CS between two transfers
+ */
+static void bcm2835_spi_sched_preempt(struct spi_master *master,
+		struct spi_message *cur)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	unsigned int class = bcm2835_spi_sched_class(cur);
+	struct spi_message *mesg;
+	unsigned long flags;
+
+	/* the holder of the bus lock gets the bus to itself */
+	if (master->bus_lock_flag)
+		return;
+
+	while (class) {
+		spin_lock_irqsave(&bs->queue_lock, flags);
+		mesg = bcm2835_spi_sched_pick(bs, class, true);
+		if (mesg)
+			bs->sched_preemptions++;
+		spin_unlock_irqrestore(&bs->queue_lock, flags);
+
+		if (!mesg)
+			return;
+
+		bcm2835_spi_do_message(master, mesg);
+		bcm2835_spi_sched_complete(bs, mesg);
+	}
+}
+
+static int bcm2835_spi_do_message(struct spi_master *master,
+		struct spi_message *mesg)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct spi_transfer *tfr, *turn;
+	struct spi_device *spi = mesg->spi;
+	struct bcm2835_spi_batch *batch;
+	struct bcm2835_spi_poll *poll;
+	/* on the stack, as preempting messages record their own */
+	struct bcm2835_spi_ts_record rec = { .msg = mesg };
+	int err = 0;
+	unsigned int timeout;
+	bool cs_change, last;
+	unsigned long flags;
+
+	bcm2835_spi_account_start(bs, mesg);
+
+	/* a batch carrier runs all the messages of the batch */
+	if (mesg->complete == bcm2835_spi_batch_complete) {
+		batch = container_of(mesg, struct bcm2835_spi_batch, carrier);
+		bcm2835_spi_batch_run(master, batch);
+		mesg->status = batch->errors ? -EIO : 0;
+		return mesg->status;
+	}
+
+	/* a poll carrier repeats its message until it matches */
+	if (mesg->complete == bcm2835_spi_poll_complete) {
+		poll = container_of(mesg, struct bcm2835_spi_poll, carrier);
+		bcm2835_spi_poll_run(master, poll);
+		mesg->status = poll->status;
+		return mesg->status;
+	}
+
+	/* a streaming capture occupies the bus until it gets stopped */
+	if (mesg == bs->stream_msg) {
+		bs->stream = container_of(mesg, struct bcm2835_spi_stream,
+					  msg);
+		tfr = list_first_entry(&mesg->transfers, struct spi_transfer,
+				       transfer_list);
+		err = bcm2835_spi_stream_run(spi, tfr);
+		bs->stream = NULL;
+		goto out;
+	}
+
+	list_for_each_entry(tfr, &mesg->transfers, transfer_list) {
+		bs->turn_tfr = bcm2835_spi_turnaround_tfr(spi, mesg, tfr);
+		bs->mem_tfr = bcm2835_spi_mem_tfr(spi, mesg, tfr,
+						  &bs->mem_hdr_len);
+
+		err = bcm2835_spi_start_transfer(spi, tfr);
+		if (err)
+			goto out;
+
+		debug_set_high2();
+		timeout = wait_for_completion_timeout(&bs->done,
+						      bs->timeout_jiffies);
+		debug_set_low2();
+
+		if (!timeout) {
+			err = -ETIMEDOUT;
+			goto out;
+		}
+
+		/* the tx phase completed together with the rx phase */
+		turn = bcm2835_spi_turnaround_tfr(spi, mesg, tfr);
+		if (turn) {
+			mesg->actual_length += tfr->len;
+			bcm2835_spi_ts_add(&rec, &bs->tfr_ts);
+			tfr = turn;
+		}
+
+		/* so did the header transfers of a flash read */
+		for (; bs->mem_tfr && (tfr != bs->mem_tfr);
+		     tfr = list_next_entry(tfr, transfer_list)) {
+			mesg->actual_length += tfr->len;
+			bcm2835_spi_ts_add(&rec, &bs->tfr_ts);
+		}
+
+		last = list_is_last(&tfr->transfer_list, &mesg->transfers);
+		cs_change = tfr->cs_change || last;
+
+		err = bcm2835_spi_finish_transfer(spi, tfr, cs_change);
+		if (err)
+			goto out;
+
+		mesg->actual_length += (tfr->len - bs->eng.len);
+
+		bcm2835_spi_ts_add(&rec, &bs->tfr_ts);
+
+		/* CS is deasserted - so more urgent messages may go first */
+		if (cs_change && !last)
+			bcm2835_spi_sched_preempt(master, mesg);
+	}
+
+out:
+	if (err == -ETIMEDOUT)
+		bcm2835_spi_recover(bs);
+	bs->turn_tfr = NULL;
+	bs->mem_tfr = NULL;
+	if (bs->cs_asserted)
+		bcm2835_spi_cs_released(bs, spi);
+
+	/* Clear FIFOs, and disable the HW block */
+	spin_lock_irqsave(&bs->cspol_lock, flags);
+	bcm2835_wr(bs, BCM2835_SPI_CS,
+		BCM2835_SPI_CS_CLEAR_RX
+		| BCM2835_SPI_CS_CLEAR_TX
+		| bs->cspol );
+	spin_unlock_irqrestore(&bs->cspol_lock, flags);
+	bcm2835_spi_gpio_cs(spi, false);
+
+	bcm2835_spi_ts_publish(bs, &rec);
+
+	mesg->status = err;
+
+	return err;
+}
+
+/*
+ * runtime power management
+ *
+ * the spi core keeps the controller resumed while it has messages
+ * and gates the clock once the bus has been idle for the autosuspend
+ * delay - which gets derived from the recent idle gaps, so that only
+ * the rare long gaps pay for the wake-up, while the common short ones
+ * find the clock still running
+ */
+
+/* gates the clock once the autosuspend delay expired */
+static int bcm2835_spi_runtime_suspend(struct device *dev)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	clk_disable_unprepare(bs->clk);
+	bs->pm_suspends++;
+
+	return 0;
+}
+
+/* ungates the clock, brings the block into a known state and times it */
+static int bcm2835_spi_wake(struct bcm2835_spi *bs)
+{
+	u64 start = ktime_get_ns();
+	int err;
+
+	err = clk_prepare_enable(bs->clk);
+	if (err)
+		return err;
+
+	bcm2835_wr(bs, BCM2835_SPI_CS,
+		   bs->cspol
+		   | BCM2835_SPI_CS_CLEAR_RX
+		   | BCM2835_SPI_CS_CLEAR_TX);
+	bcm2835_wr(bs, BCM2835_SPI_LTOH, bs->ltoh);
+
+	bs->pm_wake_ns = ktime_get_ns() - start;
+	if (bs->pm_wake_ns > bs->pm_wake_max_ns)
+		bs->pm_wake_max_ns = bs->pm_wake_ns;
+
+	return 0;
+}
+
+static int bcm2835_spi_runtime_resume(struct device *dev)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	int err;
+
+	err = bcm2835_spi_wake(bs);
+	if (err)
+		return err;
+	bs->pm_resumes++;
+
+	return 0;
+}
+
+/* the upper bound of the gap below which 90% of the gaps fall - in us */
+static u32 bcm2835_spi_pm_gap_p90(struct bcm2835_spi *bs)
+{
+	u32 sum = 0, limit;
+	unsigned long flags;
+	int b;
+
+	spin_lock_irqsave(&bs->queue_lock, flags);
+	limit = bs->pm_gap_count - bs->pm_gap_count / 10;
+	for (b = 0; b < BCM2835_SPI_PM_GAP_BUCKETS - 1; b++) {
+		sum += bs->pm_gaps[b];
+		if (sum >= limit)
+			break;
+	}
+	spin_unlock_irqrestore(&bs->queue_lock, flags);
+
+	return 1U << b;
+}
+
+/*
+ * wait out the common gaps, but at least long enough for the time
+ * spent gated to be worth the wake-up - and never gate if a single
+ * wake-up already exceeds what our clients tolerate
+ */
+static void bcm2835_spi_pm_update(struct bcm2835_spi *bs)
+{
+	struct device *dev = bs->master->dev.parent;
+	u64 delay_us;
+	int delay_ms;
+
+	mutex_lock(&bs->pm_lock);
+
+	if ((bs->pm_tolerance_us >= 0) &&
+	    ((u64)bs->pm_tolerance_us * NSEC_PER_USEC < bs->pm_wake_max_ns)) {
+		delay_ms = -1;
+	} else if (!bs->pm_gap_count) {
+		delay_ms = autosuspend_ms;
+	} else {
+		delay_us = max_t(u64, bcm2835_spi_pm_gap_p90(bs),
+				 div_u64((u64)bs->pm_wake_max_ns *
+					 BCM2835_SPI_PM_WAKE_FACTOR,
+					 NSEC_PER_USEC));
+		delay_ms = clamp_t(u64, DIV_ROUND_UP_ULL(delay_us,
+							  USEC_PER_MSEC),
+				   BCM2835_SPI_PM_MIN_DELAY_MS,
+				   BCM2835_SPI_PM_MAX_DELAY_MS);
+	}
+
+	if (delay_ms != bs->pm_delay_ms) {
+		bs->pm_delay_ms = delay_ms;
+		pm_runtime_set_autosuspend_delay(dev, delay_ms);
+	}
+
+	mutex_unlock(&bs->pm_lock);
+}
+
+/* the aggregated latency tolerance of the dev_pm_qos requests in us */
+static void bcm2835_spi_set_latency_tolerance(struct device *dev, s32 val)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	bs->pm_tolerance_us = val;
+	if (!bs->polling)
+		bcm2835_spi_pm_update(bs);
+}
+
+/* the bus was idle since the last message completed - with queue_lock */
+static void bcm2835_spi_pm_account_gap(struct bcm2835_spi *bs)
+{
+	u32 gap_us;
+	int b;
+
+	if ((bs->pm_pending++) || (!bs->pm_idle_since))
+		return;
+
+	gap_us = div_u64(ktime_get_ns() - bs->pm_idle_since, NSEC_PER_USEC);
+	b = gap_us ? min(ilog2(gap_us) + 1, BCM2835_SPI_PM_GAP_BUCKETS - 1) : 0;
+	bs->pm_gaps[b]++;
+
+	if (++bs->pm_gap_count < BCM2835_SPI_PM_GAP_LIMIT)
+		return;
+
+	bs->pm_gap_count = 0;
+	for (b = 0; b < BCM2835_SPI_PM_GAP_BUCKETS; b++) {
+		bs->pm_gaps[b] /= 2;
+		bs->pm_gap_count += bs->pm_gaps[b];
+	}
+}
+
+/* a message accounted for in bcm2835_spi_pm_account_gap() completed */
+static void bcm2835_spi_pm_account_done(struct bcm2835_spi *bs)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&bs->queue_lock, flags);
+	/* messages queued before we hooked in were not counted */
+	if (bs->pm_pending && !--bs->pm_pending)
+		bs->pm_idle_since = ktime_get_ns();
+	bs->pm_msgs++;
+	spin_unlock_irqrestore(&bs->queue_lock, flags);
+}
+
+static int bcm2835_spi_transfer_one(struct spi_master *master,
+		struct spi_message *mesg)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	debug_set_high();
+
+	bcm2835_spi_do_message(master, mesg);
+	/* queue up the next message before finalizing this one */
+	bcm2835_spi_sched_dispatch(bs, mesg);
+	/* the completion may already submit the next message */
+	bcm2835_spi_pm_account_done(bs);
+	spi_finalize_current_message(master);
+
+	debug_set_low();
+
+	/* including the messages that completed elsewhere */
+	if (READ_ONCE(bs->pm_msgs) - bs->pm_update_msgs >=
+	    BCM2835_SPI_PM_UPDATE_MSGS) {
+		bs->pm_update_msgs = READ_ONCE(bs->pm_msgs);
+		bcm2835_spi_pm_update(bs);
+	}
+
+	return 0;
+}
+
+/* appends the shape of a submitted message to the workload recording */
+static void bcm2835_spi_record(struct bcm2835_spi *bs,
+		struct spi_device *spi, struct spi_message *mesg)
+{
+	struct bcm2835_spi_rec_msg *rm;
+	struct bcm2835_spi_rec_xfer *rx;
+	struct spi_transfer *tfr;
+	unsigned int count = 0;
+	unsigned long flags;
+	u64 now;
+
+	if (!READ_ONCE(bs->rec_on))
+		return;
+
+	/* the carriers of batches and polls have no transfers */
+	list_for_each_entry(tfr, &mesg->transfers, transfer_list)
+		count++;
+	if ((!count) || (count > U16_MAX))
+		return;
+
+	spin_lock_irqsave(&bs->rec_lock, flags);
+	if (!bs->rec_on)
+		goto out;
+	if (bs->rec_size - bs->rec_used < sizeof(*rm) + count * sizeof(*rx)) {
+		bs->rec_dropped++;
+		goto out;
+	}
+
+	now = ktime_get_ns();
+	rm = (void *)(bs->rec_buf + bs->rec_used);
+	rm->delta_us = bs->rec_msgs ?
+		min_t(u64, div_u64(now - bs->rec_last_ns, 1000), U32_MAX) : 0;
+	rm->chip_select = spi->chip_select;
+	rm->mode = spi->mode;
+	rm->transfers = count;
+	rx = (void *)(rm + 1);
+	list_for_each_entry(tfr, &mesg->transfers, transfer_list) {
+		rx->len = tfr->len;
+		rx->speed_hz = tfr->speed_hz ? : spi->max_speed_hz;
+		rx->delay_usecs = tfr->delay_usecs;
+		rx->bits_per_word = tfr->bits_per_word ? : spi->bits_per_word;
+		rx->flags = (tfr->tx_buf ? BCM2835_SPI_REC_F_TX : 0) |
+			(tfr->rx_buf ? BCM2835_SPI_REC_F_RX : 0) |
+			(tfr->cs_change ? BCM2835_SPI_REC_F_CS_CHANGE : 0);
+		rx++;
+	}
+
+	bs->rec_used = (u8 *)rx - bs->rec_buf;
+	bs->rec_last_ns = now;
+	bs->rec_msgs++;
+out:
+	spin_unlock_irqrestore(&bs->rec_lock, flags);
+}
+
+/* stamp the message and let the scheduler hand it to the spi core */
+static int bcm2835_spi_transfer(struct spi_device *spi,
+		struct spi_message *mesg)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	unsigned long flags;
+
+	mesg->spi = spi;
+	mesg->status = -EINPROGRESS;
+	mesg->actual_length = 0;
+	bcm2835_spi_stamp_message(mesg);
+	bcm2835_spi_record(bs, spi, mesg);
+
+	spin_lock_irqsave(&bs->queue_lock, flags);
+	bcm2835_spi_pm_account_gap(bs);
+	bcm2835_spi_sched_queue(bs, mesg);
+	spin_unlock_irqrestore(&bs->queue_lock, flags);
+
+	bcm2835_spi_sched_dispatch(bs, NULL);
+
+	return 0;
+}
+
+/*
+ * batches of messages get run back to back from a single pump
+ * invocation and only get completed once
+ */
+static void bcm2835_spi_batch_complete(void *context)
+{
+	struct bcm2835_spi_batch *batch = context;
+
+	batch->complete(batch->context);
+}
+
+static void bcm2835_spi_batch_run(struct spi_master *master,
+		struct bcm2835_spi_batch *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++)
+		if (bcm2835_spi_do_message(master, batch->msgs[i]))
+			batch->errors++;
+}
+
+/*
+ * carriers are messages without transfers that represent a batch or
+ * a poll in the queue - they get recognized by their complete callback
+ */
+static int bcm2835_spi_queue_carrier(struct spi_device *spi,
+		struct spi_message *carrier,
+		void (*complete)(void *context), void *context)
+{
+	struct spi_master *master = spi->master;
+
+	if (master->bus_lock_flag)
+		return -EBUSY;
+
+	spi_message_init(carrier);
+	carrier->complete = complete;
+	carrier->context = context;
+	carrier->status = -EINPROGRESS;
+	carrier->actual_length = 0;
+
+	/* the carrier has no transfers, so spi_async would reject it */
+	return master->transfer(spi, carrier);
+}
+
+/* apply what spi_async would otherwise check and default for us */
+static int bcm2835_spi_validate_message(struct spi_master *master,
+		struct spi_message *mesg)
+{
+	struct spi_device *spi = mesg->spi;
+	struct spi_transfer *tfr;
+
+	if ((!spi) || (spi->master != master) ||
+	    list_empty(&mesg->transfers))
+		return -EINVAL;
+
+	list_for_each_entry(tfr, &mesg->transfers, transfer_list) {
+		if (!tfr->bits_per_word)
+			tfr->bits_per_word = spi->bits_per_word;
+		if ((!tfr->speed_hz) || (tfr->speed_hz > spi->max_speed_hz))
+			tfr->speed_hz = spi->max_speed_hz;
+		if (!(master->bits_per_word_mask &
+		      SPI_BPW_MASK(tfr->bits_per_word)))
+			return -EINVAL;
+		if (tfr->len % (tfr->bits_per_word > 16 ? 4 :
+				tfr->bits_per_word > 8 ? 2 : 1))
+			return -EINVAL;
+	}
+
+	mesg->status = -EINPROGRESS;
+	mesg->actual_length = 0;
+	bcm2835_spi_stamp_message(mesg);
+
+	return 0;
+}
+
+/**
+ * bcm2835_spi_batch_async - run a batch of messages back to back
+ * @batch: the messages and the completion callback
+ *
+ * Context: any
+ * Return: 0 on success, negative errno if the batch got rejected
+ */
+int bcm2835_spi_batch_async(struct bcm2835_spi_batch *batch)
+{
+	struct spi_master *master;
+	unsigned int i;
+	int err;
+
+	if ((!batch->count) || (!batch->msgs[0]->spi))
+		return -EINVAL;
+
+	master = batch->msgs[0]->spi->master;
+	if (master->transfer_one_message != bcm2835_spi_transfer_one)
+		return -EINVAL;
+
+	for (i = 0; i < batch->count; i++) {
+		err = bcm2835_spi_validate_message(master, batch->msgs[i]);
+		if (err)
+			return err;
+	}
+
+	batch->errors = 0;
+
+	return bcm2835_spi_queue_carrier(batch->msgs[0]->spi, &batch->carrier,
+					 bcm2835_spi_batch_complete, batch);
+}
+EXPORT_SYMBOL_GPL(bcm2835_spi_batch_async);
+
+static void bcm2835_spi_sync_complete(void *context)
+{
+	complete(context);
+}
+
+/**
+ * bcm2835_spi_batch_sync - run a batch of messages and wait for them
+ * @batch: the messages - @complete and @context get overwritten
+ *
+ * Context: can sleep
+ * Return: 0 if all messages succeeded, the first error otherwise
+ */
+int bcm2835_spi_batch_sync(struct bcm2835_spi_batch *batch)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	unsigned int i;
+	int err;
+
+	batch->complete = bcm2835_spi_sync_complete;
+	batch->context = &done;
+
+	err = bcm2835_spi_batch_async(batch);
+	if (err)
+		return err;
+
+	wait_for_completion(&done);
+
+	for (i = 0; i < batch->count; i++)
+		if (batch->msgs[i]->status)
+			return batch->msgs[i]->status;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(bcm2835_spi_batch_sync);
+
+/*
+ * poll until match: repeat a command/response message in the driver
+ * until the response matches, instead of a spi_sync round trip each
+ */
+
+/* longer intervals sleep - even when busy-polling */
+#define BCM2835_SPI_POLL_UDELAY_MAX_US	200
+
+static void bcm2835_spi_poll_complete(void *context)
+{
+	struct bcm2835_spi_poll *poll = context;
+
+	poll->complete(poll->context);
+}
+
+static void bcm2835_spi_poll_run(struct spi_master *master,
+		struct bcm2835_spi_poll *poll)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	u64 end = ktime_get_ns() + (u64)poll->timeout_us * NSEC_PER_USEC;
+	u32 response;
+	unsigned int i;
+	int err;
+
+	for (poll->polls = 1; ; poll->polls++) {
+		poll->msg->actual_length = 0;
+		err = bcm2835_spi_do_message(master, poll->msg);
+		if (err) {
+			poll->status = err;
+			return;
+		}
+
+		for (response = 0, i = 0; i < poll->match_len; i++)
+			response = (response << 8) | poll->match[i];
+		if ((response & poll->mask) == poll->value) {
+			poll->status = 0;
+			return;
+		}
+
+		if (((poll->max_polls) && (poll->polls >= poll->max_polls)) ||
+		    ((poll->timeout_us) && (ktime_get_ns() >= end))) {
+			poll->status = -ETIMEDOUT;
+			return;
+		}
+
+		/* CS is deasserted - so more urgent messages may go first */
+		bcm2835_spi_sched_preempt(master, &poll->carrier);
+
+		if (poll->interval_us) {
+			if ((poll->interval_us < 10) ||
+			    ((bs->polling) && (poll->interval_us <=
+					       BCM2835_SPI_POLL_UDELAY_MAX_US)))
+				udelay(poll->interval_us);
+			else
+				usleep_range(poll->interval_us,
+					     poll->interval_us +
+					     poll->interval_us / 4);
+		}
+	}
+}
+
+/**
+ * bcm2835_spi_poll_async - repeat a message until its response matches
+ * @poll: the message and the match condition
+ *
+ * Context: any
+ * Return: 0 on success, negative errno if the poll got rejected
+ */
+int bcm2835_spi_poll_async(struct bcm2835_spi_poll *poll)
+{
+	struct spi_master *master;
+	int err;
+
+	if ((!poll->msg->spi) || (!poll->match) ||
+	    (!poll->match_len) || (poll->match_len > 4))
+		return -EINVAL;
+	/* a response that never matches would hold the bus for good */
+	if ((!poll->timeout_us) && (!poll->max_polls))
+		return -EINVAL;
+
+	master = poll->msg->spi->master;
+	if (master->transfer_one_message != bcm2835_spi_transfer_one)
+		return -EINVAL;
+
+	err = bcm2835_spi_validate_message(master, poll->msg);
+	if (err)
+		return err;
+
+	poll->polls = 0;
+	poll->status = -EINPROGRESS;
+
+	return bcm2835_spi_queue_carrier(poll->msg->spi, &poll->carrier,
+					 bcm2835_spi_poll_complete, poll);
+}
+EXPORT_SYMBOL_GPL(bcm2835_spi_poll_async);
+
+/**
+ * bcm2835_spi_poll_sync - repeat a message until its response matches
+ * @poll: the message and the match condition,
+ *	@complete and @context get overwritten
+ *
+ * Context: can sleep
+ * Return: 0 on match, -ETIMEDOUT or the error of the message otherwise
+ */
+int bcm2835_spi_poll_sync(struct bcm2835_spi_poll *poll)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	int err;
+
+	poll->complete = bcm2835_spi_sync_complete;
+	poll->context = &done;
+
+	err = bcm2835_spi_poll_async(poll);
+	if (err)
+		return err;
+
+	wait_for_completion(&done);
+
+	return poll->status;
+}
+EXPORT_SYMBOL_GPL(bcm2835_spi_poll_sync);
+
+/**
+ * bcm2835_spi_message_timestamps - when the transfers were on the wire
+ * @mesg: a message that has completed on this controller
+ * @ts: filled with one timestamp per transfer
+ * @count: the size of @ts
+ *
+ * Only the last few messages completed on the bus are remembered,
+ * so this is best called from the completion callback or right
+ * after spi_sync() returns. At most BCM2835_SPI_MAX_TIMESTAMPS
+ * transfers get recorded per message.
+ *
+ * Context: any
+ * Return: the number of timestamps stored in @ts,
+ *	-ENOENT if @mesg is not known (anymore)
+ */
+int bcm2835_spi_message_timestamps(struct spi_message *mesg,
+		struct bcm2835_spi_timestamp *ts, unsigned int count)
+{
+	struct bcm2835_spi_ts_record rec;
+	struct spi_master *master;
+	int err;
+
+	if (!mesg->spi)
+		return -EINVAL;
+
+	master = mesg->spi->master;
+	if (master->transfer_one_message != bcm2835_spi_transfer_one)
+		return -EINVAL;
+
+	err = bcm2835_spi_ts_lookup(spi_master_get_devdata(master),
+				    mesg, &rec);
+	if (err)
+		return err;
+
+	count = min3(count, rec.count,
+		     (unsigned int)BCM2835_SPI_MAX_TIMESTAMPS);
+	memcpy(ts, rec.ts, count * sizeof(*ts));
+
+	return count;
+}
+EXPORT_SYMBOL_GPL(bcm2835_spi_message_timestamps);
+
+/* queue the message for the busy-polling thread */
+static int bcm2835_spi_poll_transfer(struct spi_device *spi,
+		struct spi_message *mesg)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	unsigned long flags;
+
+	if (bs->stopping)
+		return -ESHUTDOWN;
+
+	mesg->spi = spi;
+	mesg->status = -EINPROGRESS;
+	mesg->actual_length = 0;
+	bcm2835_spi_stamp_message(mesg);
+	bcm2835_spi_record(bs, spi, mesg);
+
+	spin_lock_irqsave(&bs->queue_lock, flags);
+	bcm2835_spi_sched_queue(bs, mesg);
+	spin_unlock_irqrestore(&bs->queue_lock, flags);
+
+	return 0;
+}
+
+static int bcm2835_spi_poll_thread(void *data)
+{
+	struct spi_master *master = data;
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct spi_message *mesg;
+	unsigned long flags;
+
+	while (!kthread_should_stop()) {
+		spin_lock_irqsave(&bs->queue_lock, flags);
+		mesg = bcm2835_spi_sched_pick(bs, BCM2835_SPI_PRIO_CLASSES,
+					      false);
+		spin_unlock_irqrestore(&bs->queue_lock, flags);
+
+		if (!mesg) {
+			/* we own this cpu, but still allow for rcu & co */
+			cond_resched();
+			cpu_relax();
+			continue;
+		}
+
+		debug_set_high();
+		bcm2835_spi_do_message(master, mesg);
+		bcm2835_spi_sched_complete(bs, mesg);
+		debug_set_low();
+	}
+
+	/* fail whatever is left in the queue */
+	for (;;) {
+		spin_lock_irqsave(&bs->queue_lock, flags);
+		mesg = bcm2835_spi_sched_pick(bs, BCM2835_SPI_PRIO_CLASSES,
+					      false);
+		spin_unlock_irqrestore(&bs->queue_lock, flags);
+		if (!mesg)
+			break;
+
+		mesg->status = -ESHUTDOWN;
+		bcm2835_spi_sched_complete(bs, mesg);
+	}
+
+	return 0;
+}
+
+static int bcm2835_spi_start_poll_thread(struct platform_device *pdev,
+		struct spi_master *master)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	if ((bs->polling_cpu >= nr_cpu_ids) || !cpu_online(bs->polling_cpu)) {
+		dev_err(&pdev->dev, "polling cpu %d is not available\n",
+			bs->polling_cpu);
+		return -EINVAL;
+	}
+
+	bs->poll_task = kthread_create(bcm2835_spi_poll_thread, master,
+				       "%s-poll", dev_name(&pdev->dev));
+	if (IS_ERR(bs->poll_task))
+		return PTR_ERR(bs->poll_task);
+
+	kthread_bind(bs->poll_task, bs->polling_cpu);
+	wake_up_process(bs->poll_task);
+
+	return 0;
+}
+
+static ssize_t bcm2835_spi_start_latency_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct bcm2835_spi_latency lat = bs->start_latency;
+
+	return scnprintf(buf, PAGE_SIZE,
+			"mode: %s\ncount: %llu\nmin_ns: %u\navg_ns: %llu\nmax_ns: %u\n",
+			bs->polling ? "polling" : "interrupt",
+			lat.count, lat.count ? lat.min_ns : 0,
+			lat.count ? div64_u64(lat.sum_ns, lat.count) : 0,
+			lat.max_ns);
+}
+
+/* any write resets the statistics */
+static ssize_t bcm2835_spi_start_latency_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	memset(&bs->start_latency, 0, sizeof(bs->start_latency));
+
+	return count;
+}
+
+static struct device_attribute dev_attr_start_latency =
+	__ATTR(start_latency, S_IRUGO | S_IWUSR,
+	       bcm2835_spi_start_latency_show,
+	       bcm2835_spi_start_latency_store);
+
+/* the speeds achievable with the current core clock - a line per divider */
+static ssize_t bcm2835_spi_speed_table_read(struct file *filp,
+		struct kobject *kobj, struct bin_attribute *attr,
+		char *buf, loff_t off, size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	unsigned long clk_hz = READ_ONCE(bs->clk_hz);
+	char line[BCM2835_SPI_SPEED_LINE_LEN + 1];
+	size_t done = 0, len;
+	u32 cdiv, pos;
+	u64 i;
+
+	while (done < count) {
+		i = div_u64_rem(off + done, BCM2835_SPI_SPEED_LINE_LEN, &pos);
+		if (i >= BCM2835_SPI_SPEED_TABLE_SIZE)
+			break;
+
+		cdiv = 2 * (i + 1);
+		snprintf(line, sizeof(line), "%5u %10u\n", cdiv,
+			 bcm2835_engine_speed(clk_hz, cdiv));
+		len = min_t(size_t, count - done,
+			    BCM2835_SPI_SPEED_LINE_LEN - pos);
+		memcpy(buf + done, line + pos, len);
+		done += len;
+	}
+
+	return done;
+}
+
+static ssize_t bcm2835_spi_effective_speed_hz_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", bs->effective_speed_hz);
+}
+
+static ssize_t bcm2835_spi_irq_cpu_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	return scnprintf(buf, PAGE_SIZE, "%d\n", bs->irq_cpu);
+}
+
+/* a negative cpu removes the pinning again */
+static ssize_t bcm2835_spi_irq_cpu_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	int cpu, err;
+
+	err = kstrtoint(buf, 0, &cpu);
+	if (err)
+		return err;
+
+	err = bcm2835_spi_set_irq_cpu(master, cpu < 0 ? -1 : cpu);
+
+	return err ? err : count;
+}
+
+static ssize_t bcm2835_spi_sched_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct bcm2835_spi_sched_stats *st;
+	ssize_t len;
+	int i;
+
+	len = scnprintf(buf, PAGE_SIZE, "preemptions: %llu\n",
+			bs->sched_preemptions);
+	for (i = 0; i < BCM2835_SPI_PRIO_CLASSES; i++) {
+		st = &bs->sched_stats[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+				 "class %d: queued %llu dispatched %llu starved %llu max_wait_ns %llu\n",
+				 i, st->queued, st->dispatched, st->starved,
+				 st->max_wait_ns);
+	}
+
+	return len;
+}
+
+/* the number of transfers that missed their deadline */
+static ssize_t bcm2835_spi_timeouts_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	return scnprintf(buf, PAGE_SIZE, "%llu\n", bs->timeouts);
+}
+
+static ssize_t bcm2835_spi_pm_stats_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "suspends: %llu\nresumes: %llu\nwake_ns: %u\nwake_max_ns: %u\nautosuspend_delay_ms: %d\ngap_p90_us: %u\nlatency_tolerance_us: %d\n",
+			 bs->pm_suspends, bs->pm_resumes, bs->pm_wake_ns,
+			 bs->pm_wake_max_ns, bs->pm_delay_ms,
+			 bs->pm_gap_count ? bcm2835_spi_pm_gap_p90(bs) : 0,
+			 bs->pm_tolerance_us);
+}
+
+static ssize_t bcm2835_spi_record_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "recording: %d\nmessages: %u\nused: %u\nsize: %u\ndropped: %u\n",
+			 bs->rec_on, bs->rec_msgs, bs->rec_used,
+			 bs->rec_size, bs->rec_dropped);
+}
+
+/* the size of a new recording buffer - 0 stops the recording */
+static ssize_t bcm2835_spi_record_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	unsigned long flags;
+	u8 *new = NULL, *old;
+	u32 size;
+	int err;
+
+	err = kstrtou32(buf, 0, &size);
+	if (err)
+		return err;
+	if (size > BCM2835_SPI_REC_MAX_SIZE)
+		return -EINVAL;
+
+	if (!size) {
+		/* keep what got recorded for reading */
+		bs->rec_on = false;
+		return count;
+	}
+
+	new = vmalloc(size);
+	if (!new)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&bs->rec_lock, flags);
+	old = bs->rec_buf;
+	bs->rec_buf = new;
+	bs->rec_size = size;
+	bs->rec_used = 0;
+	bs->rec_msgs = 0;
+	bs->rec_dropped = 0;
+	bs->rec_on = true;
+	spin_unlock_irqrestore(&bs->rec_lock, flags);
+
+	vfree(old);
+
+	return count;
+}
+
+/* the header followed by the records */
+static ssize_t bcm2835_spi_workload_read(struct file *filp,
+		struct kobject *kobj, struct bin_attribute *attr,
+		char *buf, loff_t off, size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct spi_master *master = dev_get_drvdata(dev);
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+	struct bcm2835_spi_rec_hdr hdr = {
+		.magic = BCM2835_SPI_REC_MAGIC,
+		.version = BCM2835_SPI_REC_VERSION,
+		.hdr_size = sizeof(hdr),
+		.clk_hz = bs->clk_hz,
+	};
+	unsigned long flags;
+	size_t done = 0, len;
+
+	spin_lock_irqsave(&bs->rec_lock, flags);
+	hdr.messages = bs->rec_msgs;
+	hdr.dropped = bs->rec_dropped;
+	hdr.data_size = bs->rec_used;
+
+	if (off < sizeof(hdr)) {
+		len = min_t(size_t, count, sizeof(hdr) - off);
+		memcpy(buf, (u8 *)&hdr + off, len);
+		done = len;
+		off += len;
+	}
+	if ((off >= sizeof(hdr)) && (off - sizeof(hdr) < hdr.data_size)) {
+		len = min_t(size_t, count - done,
+			    hdr.data_size - (off - sizeof(hdr)));
+		memcpy(buf + done, bs->rec_buf + off - sizeof(hdr), len);
+		done += len;
+	}
+	spin_unlock_irqrestore(&bs->rec_lock, flags);
+
+	return done;
+}
+
+static struct device_attribute dev_attr_pm_stats =
+	__ATTR(pm_stats, S_IRUGO, bcm2835_spi_pm_stats_show, NULL);
+static struct device_attribute dev_attr_timeouts =
+	__ATTR(timeouts, S_IRUGO, bcm2835_spi_timeouts_show, NULL);
+static struct device_attribute dev_attr_record =
+	__ATTR(record, S_IRUGO | S_IWUSR,
+	       bcm2835_spi_record_show, bcm2835_spi_record_store);
+static struct bin_attribute bin_attr_workload =
+	__BIN_ATTR(workload, S_IRUSR, bcm2835_spi_workload_read, NULL, 0);
+
+static struct bin_attribute bin_attr_speed_table =
+	__BIN_ATTR(speed_table, S_IRUGO, bcm2835_spi_speed_table_read, NULL,
+		   BCM2835_SPI_SPEED_TABLE_SIZE * BCM2835_SPI_SPEED_LINE_LEN);
+
+static struct bin_attribute *bcm2835_spi_bin_attrs[] = {
+	&bin_attr_speed_table,
+	&bin_attr_workload,
+	NULL,
+};
+
+static struct device_attribute dev_attr_sched_stats =
+	__ATTR(sched_stats, S_IRUGO, bcm2835_spi_sched_stats_show, NULL);
+static struct device_attribute dev_attr_irq_cpu =
+	__ATTR(irq_cpu, S_IRUGO | S_IWUSR,
+	       bcm2835_spi_irq_cpu_show, bcm2835_spi_irq_cpu_store);
+static struct device_attribute dev_attr_effective_speed_hz =
+	__ATTR(effective_speed_hz, S_IRUGO,
+	       bcm2835_spi_effective_speed_hz_show, NULL);
+
+static struct attribute *bcm2835_spi_attrs[] = {
+	&dev_attr_start_latency.attr,
+	&dev_attr_effective_speed_hz.attr,
+	&dev_attr_irq_cpu.attr,
+	&dev_attr_sched_stats.attr,
+	&dev_attr_record.attr,
+	&dev_attr_timeouts.attr,
+	&dev_attr_pm_stats.attr,
+	NULL,
+};
+
+static const struct attribute_group bcm2835_spi_attr_group = {
+	.attrs = bcm2835_spi_attrs,
+	.bin_attrs = bcm2835_spi_bin_attrs,
+};
+
+/*
+ * submission/completion ring interface for userspace
+ *
+ * userspace describes transfers in a mmap'ed submission ring,
+ * pointing into a mmap'ed data area, rings a doorbell once for
+ * many messages and reaps the completions without a syscall.
+ * The transfers point directly into the shared data area,
+ * so no copies are made.
+ *
+ * The scheduler may complete messages out of submission order, so
+ * the kernel side transfers are taken from a busy map and only
+ * released on completion - a message uses the request of its
+ * first transfer.
+ */
+#define BCM2835_SPI_RING_MAX_ENTRIES	4096
+#define BCM2835_SPI_RING_MAX_DATA	(16 * 1024 * 1024)
+
+struct bcm2835_spi_ring;
+
+struct bcm2835_spi_ring_req {
+	struct bcm2835_spi_ring *ring;
+	struct spi_message msg;
+	u64 user_data;
+	u32 count;
+};
+
+struct bcm2835_spi_ring {
+	struct spi_master *master;
+	struct list_head node;
+	struct mutex lock;
+	wait_queue_head_t wait;
+	/* the shared mapping */
+	void *map;
+	size_t map_size;
+	struct bcm2835_spi_ring_hdr *hdr;
+	struct bcm2835_spi_ring_sqe *sqes;
+	struct bcm2835_spi_ring_cqe *cqes;
+	u8 *data;
+	u32 data_size;
+	u32 sq_entries;
+	u32 cq_entries;
+	/* the kernel side of the indices */
+	u32 sq_head;
+	u32 cq_tail;
+	spinlock_t cq_lock;
+	/* sqes and messages that have not completed yet */
+	atomic_t inflight;
+	atomic_t inflight_msgs;
+	/* one request and transfer per sq slot - busy while in flight */
+	struct bcm2835_spi_ring_req *reqs;
+	struct spi_transfer *xfers;
+	unsigned long *busy;
+	struct spi_device *spi[U8_MAX + 1];
+};
+
+static void bcm2835_spi_ring_post(struct bcm2835_spi_ring *ring,
+		u64 user_data, int status, u32 actual_length,
+		const struct bcm2835_spi_timestamp *span)
+{
+	static const struct bcm2835_spi_timestamp none;
+	struct bcm2835_spi_ring_cqe *cqe;
+	unsigned long flags;
+
+	if (!span)
+		span = &none;
+
+	spin_lock_irqsave(&ring->cq_lock, flags);
+	cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+	cqe->user_data = user_data;
+	cqe->status = status;
+	cqe->actual_length = actual_length;
+	cqe->start_ns = span->start_ns;
+	cqe->end_ns = span->end_ns;
+	cqe->start_err_ns = span->start_err_ns;
+	cqe->end_err_ns = span->end_err_ns;
+	ring->cq_tail++;
+	smp_store_release(&ring->hdr->cq.tail, ring->cq_tail);
+	spin_unlock_irqrestore(&ring->cq_lock, flags);
+
+	wake_up_interruptible(&ring->wait);
+}
+
+static void bcm2835_spi_ring_complete(void *context)
+{
+	struct bcm2835_spi_ring_req *req = context;
+	struct bcm2835_spi_ring *ring = req->ring;
+	struct bcm2835_spi *bs = spi_master_get_devdata(ring->master);
+	struct bcm2835_spi_ts_record rec;
+	struct spi_transfer *xfer;
+	u32 count = req->count;
+	u32 slot = req - ring->reqs;
+
+	bcm2835_spi_ring_post(ring, req->user_data,
+			      req->msg.status, req->msg.actual_length,
+			      bcm2835_spi_ts_lookup(bs, &req->msg, &rec) ?
+			      NULL : &rec.span);
+
+	/* the slot of the request goes last, it may get reused right away */
+	list_for_each_entry(xfer, &req->msg.transfers, transfer_list)
+		if (xfer != &ring->xfers[slot])
+			clear_bit(xfer - ring->xfers, ring->busy);
+	clear_bit_unlock(slot, ring->busy);
+
+	atomic_sub(count, &ring->inflight);
+	atomic_dec(&ring->inflight_msgs);
+	/* release waits for this */
+	wake_up(&ring->wait);
+}
+
+static int bcm2835_spi_match_cs(struct device *dev, void *data)
+{
+	return to_spi_device(dev)->chip_select == *(u8 *)data;
+}
+
+/* returns the spi_device on this chip select with a reference held */
+static struct spi_device *bcm2835_spi_get_device(struct spi_master *master,
+		u8 cs)
+{
+	struct device *dev;
+
+	if (cs >= master->num_chipselect)
+		return NULL;
+
+	dev = device_find_child(&master->dev, &cs, bcm2835_spi_match_cs);
+
+	return dev ? to_spi_device(dev) : NULL;
+}
+
+/*
+ * userspace may only drive devices that no kernel driver owns - or that
+ * are bound to spidev, which hands them to userspace anyway
+ */
+static bool bcm2835_spi_user_device(struct spi_device *spi)
+{
+	struct device_driver *drv = READ_ONCE(spi->dev.driver);
+
+	return (!drv) || (!strcmp(drv->name, "spidev"));
+}
+
+static struct spi_device *bcm2835_spi_ring_get_spi(
+	struct bcm2835_spi_ring *ring, u8 cs, int *err)
+{
+	if (!ring->spi[cs])
+		ring->spi[cs] = bcm2835_spi_get_device(ring->master, cs);
+
+	if (!ring->spi[cs]) {
+		*err = -ENODEV;
+		return NULL;
+	}
+	/* checked for every message, a driver may have bound since */
+	if (!bcm2835_spi_user_device(ring->spi[cs])) {
+		*err = -EBUSY;
+		return NULL;
+	}
+
+	return ring->spi[cs];
+}
+
+/* there is a free one for each sqe not in flight */
+static u32 bcm2835_spi_ring_get_slot(struct bcm2835_spi_ring *ring)
+{
+	u32 slot = find_first_zero_bit(ring->busy, ring->sq_entries);
+
+	set_bit(slot, ring->busy);
+
+	return slot;
+}
+
+static void *bcm2835_spi_ring_buf(struct bcm2835_spi_ring *ring,
+		u32 offset, u32 len, int *err)
+{
+	if (offset == BCM2835_SPI_RING_NO_BUF)
+		return NULL;
+	if ((offset > ring->data_size) || (len > ring->data_size - offset)) {
+		*err = -EFAULT;
+		return NULL;
+	}
+
+	return ring->data + offset;
+}
+
+/* the doorbell: submit all complete messages in the submission ring */
+static int bcm2835_spi_ring_enter(struct bcm2835_spi_ring *ring)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(ring->master);
+	struct bcm2835_spi_ring_sqe sqe;
+	struct bcm2835_spi_ring_req *req;
+	struct spi_transfer *xfer;
+	struct spi_device *spi;
+	u32 head, tail, count, i, slot, cq_used;
+	int submitted = 0;
+	int err;
+
+	mutex_lock(&ring->lock);
+
+	/* the controller is going away */
+	if (bs->misc_gone) {
+		mutex_unlock(&ring->lock);
+		return -ENODEV;
+	}
+
+	head = ring->sq_head;
+	tail = smp_load_acquire(&ring->hdr->sq.tail);
+	if (tail - head > ring->sq_entries) {
+		mutex_unlock(&ring->lock);
+		return -EINVAL;
+	}
+
+	while (head != tail) {
+		/* find the end of the message */
+		for (count = 1; head + count != tail + 1; count++)
+			if (!(READ_ONCE(ring->sqes[(head + count - 1) &
+						   (ring->sq_entries - 1)].flags)
+			      & BCM2835_SPI_RING_F_LINK))
+				break;
+		/* an incomplete message - wait for the next doorbell */
+		if (head + count == tail + 1)
+			break;
+
+		/* respect the sq slots and the room in the cq */
+		if (count > ring->sq_entries - atomic_read(&ring->inflight))
+			break;
+		cq_used = ring->cq_tail - READ_ONCE(ring->hdr->cq.head)
+			+ atomic_read(&ring->inflight_msgs);
+		if (cq_used >= ring->cq_entries)
+			break;
+
+		slot = bcm2835_spi_ring_get_slot(ring);
+		req = &ring->reqs[slot];
+		/* a message failing before it runs has no timestamps */
+		bcm2835_spi_ts_forget(bs, &req->msg);
+		req->count = count;
+		spi_message_init(&req->msg);
+		req->msg.complete = bcm2835_spi_ring_complete;
+		req->msg.context = req;
+
+		err = 0;
+		spi = NULL;
+		for (i = 0; i < count; i++) {
+			/* userspace may still modify it - so work on a copy */
+			memcpy(&sqe, &ring->sqes[(head + i) &
+						 (ring->sq_entries - 1)],
+			       sizeof(sqe));
+
+			if (!i)
+				spi = bcm2835_spi_ring_get_spi(ring,
+							       sqe.chip_select,
+							       &err);
+			req->user_data = sqe.user_data;
+
+			if (i)
+				slot = bcm2835_spi_ring_get_slot(ring);
+			xfer = &ring->xfers[slot];
+			memset(xfer, 0, sizeof(*xfer));
+			xfer->tx_buf = bcm2835_spi_ring_buf(ring, sqe.tx_offset,
+							    sqe.len, &err);
+			xfer->rx_buf = bcm2835_spi_ring_buf(ring, sqe.rx_offset,
+							    sqe.len, &err);
+			xfer->len = sqe.len;
+			xfer->speed_hz = sqe.speed_hz;
+			xfer->bits_per_word = sqe.bits_per_word;
+			xfer->delay_usecs = sqe.delay_usecs;
+			xfer->cs_change = sqe.cs_change;
+			spi_message_add_tail(xfer, &req->msg);
+		}
+		head += count;
+		submitted += count;
+
+		atomic_add(count, &ring->inflight);
+		atomic_inc(&ring->inflight_msgs);
+		if (!err)
+			err = spi_async(spi, &req->msg);
+		if (err) {
+			req->msg.status = err;
+			req->msg.actual_length = 0;
+			bcm2835_spi_ring_complete(req);
+		}
+	}
+
+	ring->sq_head = head;
+	smp_store_release(&ring->hdr->sq.head, head);
+
+	mutex_unlock(&ring->lock);
+
+	return submitted;
+}
+
+static int bcm2835_spi_ring_setup(struct bcm2835_spi_ring *ring,
+		struct bcm2835_spi_ring_setup *setup)
+{
+	u32 sq_entries, cq_entries;
+
+	if (ring->map)
+		return -EBUSY;
+
+	if ((!setup->sq_entries) ||
+	    (setup->sq_entries > BCM2835_SPI_RING_MAX_ENTRIES) ||
+	    (setup->cq_entries > BCM2835_SPI_RING_MAX_ENTRIES) ||
+	    (setup->data_size > BCM2835_SPI_RING_MAX_DATA))
+		return -EINVAL;
+
+	sq_entries = roundup_pow_of_two(setup->sq_entries);
+	cq_entries = roundup_pow_of_two(max(setup->cq_entries, sq_entries));
+
+	setup->sq_entries = sq_entries;
+	setup->cq_entries = cq_entries;
+	setup->sq_offset = L1_CACHE_ALIGN(sizeof(*ring->hdr));
+	setup->cq_offset = L1_CACHE_ALIGN(setup->sq_offset +
+				sq_entries * sizeof(*ring->sqes));
+	setup->data_offset = PAGE_ALIGN(setup->cq_offset +
+				cq_entries * sizeof(*ring->cqes));
+	setup->map_size = PAGE_ALIGN(setup->data_offset + setup->data_size);
+
+	ring->reqs = kcalloc(sq_entries, sizeof(*ring->reqs), GFP_KERNEL);
+	ring->xfers = kcalloc(sq_entries, sizeof(*ring->xfers), GFP_KERNEL);
+	ring->busy = kcalloc(BITS_TO_LONGS(sq_entries), sizeof(*ring->busy),
+			     GFP_KERNEL);
+	ring->map = vmalloc_user(setup->map_size);
+	if ((!ring->reqs) || (!ring->xfers) || (!ring->busy) || (!ring->map)) {
+		kfree(ring->reqs);
+		kfree(ring->xfers);
+		kfree(ring->busy);
+		vfree(ring->map);
+		ring->reqs = NULL;
+		ring->xfers = NULL;
+		ring->busy = NULL;
+		ring->map = NULL;
+		return -ENOMEM;
+	}
+
+	ring->map_size = setup->map_size;
+	ring->hdr = ring->map;
+	ring->sqes = ring->map + setup->sq_offset;
+	ring->cqes = ring->map + setup->cq_offset;
+	ring->data = ring->map + setup->data_offset;
+	ring->data_size = setup->data_size;
+	ring->sq_entries = sq_entries;
+	ring->cq_entries = cq_entries;
+
+	return 0;
+}
+
+static long bcm2835_spi_ring_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg)
+{
+	struct bcm2835_spi_ring *ring = file->private_data;
+	struct bcm2835_spi_ring_setup setup;
+	int err;
+
+	switch (cmd) {
+	case BCM2835_SPI_RING_IOC_SETUP:
+		if (copy_from_user(&setup, (void __user *)arg, sizeof(setup)))
+			return -EFAULT;
+		mutex_lock(&ring->lock);
+		err = bcm2835_spi_ring_setup(ring, &setup);
+		mutex_unlock(&ring->lock);
+		if (err)
+			return err;
+		if (copy_to_user((void __user *)arg, &setup, sizeof(setup)))
+			return -EFAULT;
+		return 0;
+	case BCM2835_SPI_RING_IOC_ENTER:
+		if (!ring->map)
+			return -EINVAL;
+		return bcm2835_spi_ring_enter(ring);
+	default:
+		return -ENOTTY;
+	}
+}
 
-/* the time we will poll the device */
-#define BCM2835_SPI_POLLTIME_US 20
+static int bcm2835_spi_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct bcm2835_spi_ring *ring = file->private_data;
 
-#define DRV_NAME	"spi-bcm2835"
+	if (!ring->map)
+		return -EINVAL;
 
-struct bcm2835_spi {
-	void __iomem *regs;
-	struct clk *clk;
-	int irq;
-	struct completion done;
-	const u8 *tx_buf;
-	u8 *rx_buf;
-	int len;
-	u8 bits_per_word;
-	spinlock_t cspol_lock;
-	u32 cspol;
-};
+	return remap_vmalloc_range(vma, ring->map, vma->vm_pgoff);
+}
 
-static inline u32 bcm2835_rd(struct bcm2835_spi *bs, unsigned reg)
+static unsigned int bcm2835_spi_ring_poll(struct file *file, poll_table *wait)
 {
-	return readl(bs->regs + reg);
+	struct bcm2835_spi_ring *ring = file->private_data;
+
+	if (!ring->map)
+		return POLLERR;
+
+	poll_wait(file, &ring->wait, wait);
+
+	if (smp_load_acquire(&ring->hdr->cq.tail) !=
+	    READ_ONCE(ring->hdr->cq.head))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
 }
 
-static inline void bcm2835_wr(struct bcm2835_spi *bs, unsigned reg, u32 val)
+static int bcm2835_spi_ring_open(struct inode *inode, struct file *file)
 {
-	writel(val, bs->regs + reg);
+	struct miscdevice *misc = file->private_data;
+	struct bcm2835_spi *bs = container_of(misc, struct bcm2835_spi,
+					      ring_misc);
+	struct bcm2835_spi_ring *ring;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	mutex_init(&ring->lock);
+	init_waitqueue_head(&ring->wait);
+	spin_lock_init(&ring->cq_lock);
+	atomic_set(&ring->inflight, 0);
+	atomic_set(&ring->inflight_msgs, 0);
+
+	/* the file may outlive the controller - remove revokes it then */
+	mutex_lock(&bs->misc_lock);
+	if (bs->misc_gone) {
+		mutex_unlock(&bs->misc_lock);
+		kfree(ring);
+		return -ENODEV;
+	}
+	ring->master = spi_master_get(bs->master);
+	list_add(&ring->node, &bs->rings);
+	mutex_unlock(&bs->misc_lock);
+
+	file->private_data = ring;
+
+	return nonseekable_open(inode, file);
 }
 
-static inline void bcm2835_rd_fifo(struct bcm2835_spi *bs)
+static int bcm2835_spi_ring_release(struct inode *inode, struct file *file)
 {
-	u8 byte;
+	struct bcm2835_spi_ring *ring = file->private_data;
+	struct bcm2835_spi *bs = spi_master_get_devdata(ring->master);
+	int i;
 
-	while (bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_RXD) {
-		byte = bcm2835_rd(bs, BCM2835_SPI_FIFO);
-		if (bs->rx_buf)
-			*bs->rx_buf++ = byte;
-	}
+	mutex_lock(&bs->misc_lock);
+	list_del(&ring->node);
+	mutex_unlock(&bs->misc_lock);
+
+	/* the messages still reference the buffers */
+	wait_event(ring->wait, !atomic_read(&ring->inflight));
+
+	for (i = 0; i < ARRAY_SIZE(ring->spi); i++)
+		if (ring->spi[i])
+			put_device(&ring->spi[i]->dev);
+
+	vfree(ring->map);
+	kfree(ring->busy);
+	kfree(ring->xfers);
+	kfree(ring->reqs);
+	spi_master_put(ring->master);
+	kfree(ring);
+
+	return 0;
 }
 
-static inline void bcm2835_wr_fifo(struct bcm2835_spi *bs)
+static const struct file_operations bcm2835_spi_ring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= bcm2835_spi_ring_open,
+	.release	= bcm2835_spi_ring_release,
+	.unlocked_ioctl	= bcm2835_spi_ring_ioctl,
+	.mmap		= bcm2835_spi_ring_mmap,
+	.poll		= bcm2835_spi_ring_poll,
+	.llseek		= no_llseek,
+};
+
+static void bcm2835_spi_stream_complete(void *context)
 {
-	u32 val;
+	struct bcm2835_spi_stream *st = context;
 
-	while ( (bs->len)
-		&& (bcm2835_rd(bs, BCM2835_SPI_CS) & BCM2835_SPI_CS_TXD)
-		) {
-		val = 0;
-		if (bs->bits_per_word == 9) {
-			if (bs->tx_buf) {
-				val = *(const u16 *)bs->tx_buf;
-				bs->tx_buf += 2;
-			}
-			bs->len-=2;
-		} else {
-			if (bs->tx_buf) {
-				val = *bs->tx_buf++;
-			}
-			bs->len--;
+	complete(&st->msg_done);
+}
+
+static int bcm2835_spi_stream_setup(struct bcm2835_spi_stream *st,
+		struct bcm2835_spi_stream_setup *setup)
+{
+	struct bcm2835_spi *bs = st->bs;
+	size_t ts_size;
+
+	if (st->map)
+		return -EBUSY;
+
+	if ((!setup->frame_len) ||
+	    (setup->frame_len > BCM2835_SPI_STREAM_MAX_FRAME) ||
+	    (!setup->frames) ||
+	    (setup->frames > BCM2835_SPI_STREAM_MAX_FRAMES) ||
+	    (roundup_pow_of_two(setup->frames) *
+	     ALIGN(setup->frame_len, sizeof(u64)) >
+	     BCM2835_SPI_STREAM_MAX_DATA))
+		return -EINVAL;
+
+	st->spi = bcm2835_spi_get_device(bs->master, setup->chip_select);
+	if (!st->spi)
+		return -ENODEV;
+	if (!bcm2835_spi_user_device(st->spi)) {
+		put_device(&st->spi->dev);
+		st->spi = NULL;
+		return -EBUSY;
+	}
+
+	if (setup->tx_template) {
+		if (copy_from_user(st->tx, (void __user *)(uintptr_t)
+				   setup->tx_template, setup->frame_len)) {
+			put_device(&st->spi->dev);
+			st->spi = NULL;
+			return -EFAULT;
 		}
-		bcm2835_wr(bs, BCM2835_SPI_FIFO, val);
 	}
+
+	st->frame_len = setup->frame_len;
+	st->frame_stride = ALIGN(setup->frame_len, sizeof(u64));
+	st->frames = roundup_pow_of_two(setup->frames);
+	st->flags = setup->flags;
+	st->speed_hz = setup->speed_hz;
+
+	ts_size = (st->flags & BCM2835_SPI_STREAM_F_TIMESTAMP) ?
+		PAGE_ALIGN(st->frames * sizeof(u64)) : 0;
+
+	setup->frames = st->frames;
+	setup->frame_stride = st->frame_stride;
+	setup->timestamp_offset = ts_size ? PAGE_SIZE : 0;
+	setup->data_offset = PAGE_SIZE + ts_size;
+	setup->map_size = PAGE_ALIGN(setup->data_offset +
+				     st->frames * st->frame_stride);
+
+	st->map = vmalloc_user(setup->map_size);
+	if (!st->map) {
+		put_device(&st->spi->dev);
+		st->spi = NULL;
+		return -ENOMEM;
+	}
+
+	st->map_size = setup->map_size;
+	st->hdr = st->map;
+	st->hdr->frames = st->frames;
+	st->timestamps = st->map + setup->timestamp_offset;
+	st->data = st->map + setup->data_offset;
+
+	return 0;
 }
 
-static irqreturn_t bcm2835_spi_interrupt(int irq, void *dev_id)
+static int bcm2835_spi_stream_start(struct bcm2835_spi_stream *st)
 {
-	struct spi_master *master = dev_id;
-	struct bcm2835_spi *bs = spi_master_get_devdata(master);
-	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
-	debug_set_high3();
+	struct bcm2835_spi *bs = st->bs;
+	int err;
 
-	/* Read as many bytes of data as possible */
-	bcm2835_rd_fifo(bs);
+	if (!st->map)
+		return -EINVAL;
+	if (st->running)
+		return -EBUSY;
+
+	spi_message_init(&st->msg);
+	memset(&st->xfer, 0, sizeof(st->xfer));
+	st->xfer.tx_buf = st->tx;
+	st->xfer.rx_buf = st->data;
+	st->xfer.len = st->frame_len;
+	st->xfer.speed_hz = st->speed_hz;
+	spi_message_add_tail(&st->xfer, &st->msg);
+	st->msg.complete = bcm2835_spi_stream_complete;
+	st->msg.context = st;
+	reinit_completion(&st->msg_done);
+	st->stop = false;
+
+	/* nobody else may use the bus while we are streaming */
+	spi_bus_lock(bs->master);
+	bs->stream_msg = &st->msg;
+	err = spi_async_locked(st->spi, &st->msg);
+	if (err) {
+		bs->stream_msg = NULL;
+		spi_bus_unlock(bs->master);
+		return err;
+	}
 
-	/* Write as many bytes of data as possible */
-	bcm2835_wr_fifo(bs);
+	st->running = true;
 
-	/* if length is empty, then disable interrupts */
-	if (! bs->len) {
-		/* Disable SPI interrupts */
-		cs &= ~(BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
-		bcm2835_wr(bs, BCM2835_SPI_CS, cs);
+	return 0;
+}
 
-		/*
-		 * Wake up bcm2835_spi_transfer_one(), which will call
-		 * bcm2835_spi_finish_transfer(), to drain the RX FIFO.
-		 */
-		complete(&bs->done);
+/*
+ * the stream ends with the frame in progress - or once the message pump
+ * has noticed that it stalled, so this is only a safety net
+ */
+#define BCM2835_SPI_STREAM_STOP_MS	1000
+
+static int bcm2835_spi_stream_stop(struct bcm2835_spi_stream *st)
+{
+	struct bcm2835_spi *bs = st->bs;
+
+	if (!st->running)
+		return 0;
+
+	WRITE_ONCE(st->stop, true);
+	if (!wait_for_completion_timeout(&st->msg_done,
+			msecs_to_jiffies(BCM2835_SPI_STREAM_STOP_MS +
+					 timeout_margin_us / USEC_PER_MSEC))) {
+		dev_warn(&bs->master->dev, "stream did not stop in time\n");
+		return -ETIMEDOUT;
 	}
 
-	debug_set_low3();
-	return IRQ_HANDLED;
+	bs->stream_msg = NULL;
+	spi_bus_unlock(bs->master);
+	st->running = false;
+
+	return st->msg.status;
 }
 
-static int bcm2835_spi_start_transfer(struct spi_device *spi,
-		struct spi_transfer *tfr)
+static long bcm2835_spi_stream_ioctl(struct file *file, unsigned int cmd,
+		unsigned long arg)
 {
-	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
-	unsigned long spi_hz, clk_hz, cdiv,xfer_time_us;
-	u32 cs = BCM2835_SPI_CS_TA;
-	unsigned long flags;
+	struct bcm2835_spi_stream *st = file->private_data;
+	struct bcm2835_spi_stream_setup setup;
+	int err;
 
-	spi_hz = tfr->speed_hz;
-	clk_hz = clk_get_rate(bs->clk);
+	mutex_lock(&st->lock);
+	/* the controller is going away */
+	if (st->bs->misc_gone) {
+		mutex_unlock(&st->lock);
+		return -ENODEV;
+	}
+	switch (cmd) {
+	case BCM2835_SPI_STREAM_IOC_SETUP:
+		if (copy_from_user(&setup, (void __user *)arg,
+				   sizeof(setup))) {
+			err = -EFAULT;
+			break;
+		}
+		err = bcm2835_spi_stream_setup(st, &setup);
+		if ((!err) && copy_to_user((void __user *)arg, &setup,
+					   sizeof(setup)))
+			err = -EFAULT;
+		break;
+	case BCM2835_SPI_STREAM_IOC_START:
+		err = bcm2835_spi_stream_start(st);
+		break;
+	case BCM2835_SPI_STREAM_IOC_STOP:
+		err = bcm2835_spi_stream_stop(st);
+		break;
+	default:
+		err = -ENOTTY;
+	}
+	mutex_unlock(&st->lock);
 
-	if (spi_hz >= clk_hz / 2) {
-		cdiv = 2; /* clk_hz/2 is the fastest we can go */
-	} else if (spi_hz) {
-		/* CDIV must be a power of two */
-		cdiv = DIV_ROUND_UP(clk_hz, spi_hz);
-		/* make the divider "even" by rounding up
-		 * this ensures that the phases are of equal length
-		 */
-		cdiv += (cdiv % 2) ;
+	return err;
+}
 
-		if (cdiv >= 65536)
-			cdiv = 0; /* 0 is the slowest we can go */
-	} else
-		cdiv = 0; /* 0 is the slowest we can go */
+static int bcm2835_spi_stream_mmap(struct file *file,
+		struct vm_area_struct *vma)
+{
+	struct bcm2835_spi_stream *st = file->private_data;
 
-	if (spi->mode & SPI_CPOL)
-		cs |= BCM2835_SPI_CS_CPOL;
-	if (spi->mode & SPI_CPHA)
-		cs |= BCM2835_SPI_CS_CPHA;
+	if (!st->map)
+		return -EINVAL;
 
-	if (!(spi->mode & SPI_NO_CS)) {
-		cs |= spi->chip_select;
+	return remap_vmalloc_range(vma, st->map, vma->vm_pgoff);
+}
+
+static unsigned int bcm2835_spi_stream_poll(struct file *file,
+		poll_table *wait)
+{
+	struct bcm2835_spi_stream *st = file->private_data;
+
+	if (!st->map)
+		return POLLERR;
+
+	poll_wait(file, &st->wait, wait);
+
+	if (smp_load_acquire(&st->hdr->producer) !=
+	    READ_ONCE(st->hdr->consumer))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static int bcm2835_spi_stream_open(struct inode *inode, struct file *file)
+{
+	struct miscdevice *misc = file->private_data;
+	struct bcm2835_spi *bs = container_of(misc, struct bcm2835_spi,
+					      stream_misc);
+	struct bcm2835_spi_stream *st;
+
+	/* there is only a single bus to stream on */
+	if (test_and_set_bit(0, &bs->stream_open))
+		return -EBUSY;
+
+	st = kzalloc(sizeof(*st), GFP_KERNEL);
+	if (!st) {
+		clear_bit(0, &bs->stream_open);
+		return -ENOMEM;
 	}
 
-	spin_lock_irqsave(&bs->cspol_lock, flags);
-	cs |= bs->cspol;
-	spin_unlock_irqrestore(&bs->cspol_lock, flags);
+	st->bs = bs;
+	mutex_init(&st->lock);
+	init_waitqueue_head(&st->wait);
+	init_completion(&st->msg_done);
+	init_completion(&st->stopped);
+
+	/* the file may outlive the controller - remove revokes it then */
+	mutex_lock(&bs->misc_lock);
+	if (bs->misc_gone) {
+		mutex_unlock(&bs->misc_lock);
+		kfree(st);
+		clear_bit(0, &bs->stream_open);
+		return -ENODEV;
+	}
+	spi_master_get(bs->master);
+	bs->stream_ctx = st;
+	mutex_unlock(&bs->misc_lock);
 
-	/* LoSSI/9-bit mode */
-	if (spi->bits_per_word == 9)
-		cs |= BCM2835_SPI_CS_LEN;
+	file->private_data = st;
 
-	/* 3-WIRE mode */
-	if ( (spi->mode & SPI_3WIRE) && (tfr->rx_buf) )
-		cs |= BCM2835_SPI_CS_REN;
+	return nonseekable_open(inode, file);
+}
 
-	reinit_completion(&bs->done);
-	bs->tx_buf = tfr->tx_buf;
-	bs->rx_buf = tfr->rx_buf;
-	bs->len = tfr->len;
-	bs->bits_per_word = spi->bits_per_word;
+static int bcm2835_spi_stream_release(struct inode *inode, struct file *file)
+{
+	struct bcm2835_spi_stream *st = file->private_data;
+	struct bcm2835_spi *bs = st->bs;
 
-        bcm2835_wr(bs, BCM2835_SPI_CLK, cdiv);
-        /** Enable the HW block, but without the interrupts enabled,
-         * so that we can fill in some data into the fifo now
-         * and avoid delays doe to interrupt overheads...
-         */
-        bcm2835_wr(bs, BCM2835_SPI_CS, cs);
-        /* Write as many bytes of data as possible */
-        bcm2835_wr_fifo(bs);
-
-	/* calculate how long we have to wait aproximately */
-	xfer_time_us = cdiv
-		* 9 /* 8bit + 1 clock gap */
-		* tfr->len /* times the number of bytes to transfer */
-		* 1000000 /* get the measure in us */
-		/ clk_hz
+	mutex_lock(&bs->misc_lock);
+	bs->stream_ctx = NULL;
+	mutex_unlock(&bs->misc_lock);
+
+	/* the message still uses the buffers - so keep waiting for it */
+	while (bcm2835_spi_stream_stop(st) == -ETIMEDOUT)
 		;
 
-	/* if the time is bigger than the given BCM2835_SPI_POLLTIME_US
-	 * or we still have bytes to transfer
-	 * then run the interrupt
-	 * note that this still hides the fact that the interrupt+wakeup
-	 * is "expensive" and we should do all transfers in a message
-	 * without waking up the worker thread
-	 */
-	if ((bs->len) || (xfer_time_us > BCM2835_SPI_POLLTIME_US))  {
-		/* and now enable the interrupt for TX-empty*/
-		bcm2835_wr(bs, BCM2835_SPI_CS,
-			cs | BCM2835_SPI_CS_INTR | BCM2835_SPI_CS_INTD);
-	} else {
-		/* poll until we get there */
-		while (!(bcm2835_rd(bs, BCM2835_SPI_CS)
-				& BCM2835_SPI_CS_DONE)) ;
-		/* and set completed */
-		complete(&bs->done);
-	}
+	if (st->spi)
+		put_device(&st->spi->dev);
+	vfree(st->map);
+	kfree(st);
+
+	clear_bit(0, &bs->stream_open);
+	spi_master_put(bs->master);
 
 	return 0;
 }
 
-static int bcm2835_spi_finish_transfer(struct spi_device *spi,
-		struct spi_transfer *tfr, bool cs_change)
+static const struct file_operations bcm2835_spi_stream_fops = {
+	.owner		= THIS_MODULE,
+	.open		= bcm2835_spi_stream_open,
+	.release	= bcm2835_spi_stream_release,
+	.unlocked_ioctl	= bcm2835_spi_stream_ioctl,
+	.mmap		= bcm2835_spi_stream_mmap,
+	.poll		= bcm2835_spi_stream_poll,
+	.llseek		= no_llseek,
+};
+
+/*
+ * open files keep the controller memory alive, but not the hardware:
+ * stop their messages and fail anything they submit from now on
+ */
+static void bcm2835_spi_revoke_misc(struct bcm2835_spi *bs)
 {
-	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
-	u32 cs = bcm2835_rd(bs, BCM2835_SPI_CS);
+	struct bcm2835_spi_ring *ring;
+	struct bcm2835_spi_stream *st;
 
-	/* Drain RX FIFO */
-	bcm2835_rd_fifo(bs);
+	mutex_lock(&bs->misc_lock);
+	bs->misc_gone = true;
 
-	if (tfr->delay_usecs) {
-		debug_set_high2();
-		udelay(tfr->delay_usecs);
-		debug_set_low2();
+	list_for_each_entry(ring, &bs->rings, node) {
+		/* an enter in progress still submits */
+		mutex_lock(&ring->lock);
+		mutex_unlock(&ring->lock);
+		wait_event(ring->wait, !atomic_read(&ring->inflight));
 	}
 
-	if (cs_change)
-		/* Clear TA flag */
-		bcm2835_wr(bs, BCM2835_SPI_CS, cs & ~BCM2835_SPI_CS_TA);
+	st = bs->stream_ctx;
+	if (st) {
+		mutex_lock(&st->lock);
+		while (bcm2835_spi_stream_stop(st) == -ETIMEDOUT)
+			;
+		mutex_unlock(&st->lock);
+	}
 
-	return 0;
+	mutex_unlock(&bs->misc_lock);
 }
 
-static int bcm2835_spi_transfer_one(struct spi_master *master,
-		struct spi_message *mesg)
+static void bcm2835_spi_register_misc(struct platform_device *pdev,
+		struct miscdevice *misc, char *name, size_t size,
+		const char *suffix, const struct file_operations *fops)
 {
-	struct bcm2835_spi *bs = spi_master_get_devdata(master);
-	struct spi_transfer *tfr;
-	struct spi_device *spi = mesg->spi;
-	int err = 0;
-	unsigned int timeout;
-	bool cs_change;
-	unsigned long flags;
+	struct spi_master *master = platform_get_drvdata(pdev);
+	int err;
 
-	debug_set_high();
+	snprintf(name, size, "%s-%s", dev_name(&master->dev), suffix);
+	misc->minor = MISC_DYNAMIC_MINOR;
+	misc->name = name;
+	misc->fops = fops;
+	misc->parent = &pdev->dev;
 
-	list_for_each_entry(tfr, &mesg->transfers, transfer_list) {
-		err = bcm2835_spi_start_transfer(spi, tfr);
-		if (err)
-			goto out;
+	/* these interfaces are optional, so just warn */
+	err = misc_register(misc);
+	if (err) {
+		dev_warn(&pdev->dev, "could not register %s: %d\n",
+			 name, err);
+		misc->name = NULL;
+	}
+}
 
-		debug_set_high2();
-		timeout = wait_for_completion_timeout(&bs->done,
-				msecs_to_jiffies(BCM2835_SPI_TIMEOUT_MS));
-		debug_set_low2();
+/*
+ * gpio chip-selects get toggled by writing the GPSET/GPCLR registers
+ * directly if they belong to the SoC gpio block, as going via gpiolib
+ * would add to the CS setup/hold times
+ */
+static int bcm2835_spi_setup_cs_gpio(struct spi_device *spi)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_dev *dev = spi->controller_state;
+	struct gpio_chip *chip;
+	unsigned int pin;
+	int err;
 
-		if (!timeout) {
-			err = -ETIMEDOUT;
-			goto out;
+	if (!dev->cs_gpio) {
+		err = gpio_request_one(spi->cs_gpio,
+				       (spi->mode & SPI_CS_HIGH) ?
+				       GPIOF_OUT_INIT_LOW : GPIOF_OUT_INIT_HIGH,
+				       dev_name(&spi->dev));
+		if (err) {
+			dev_err(&spi->dev, "could not request cs gpio %d: %d\n",
+				spi->cs_gpio, err);
+			return err;
 		}
 
-		cs_change = tfr->cs_change ||
-			list_is_last(&tfr->transfer_list, &mesg->transfers);
-
-		err = bcm2835_spi_finish_transfer(spi, tfr, cs_change);
-		if (err)
-			goto out;
-
-		mesg->actual_length += (tfr->len - bs->len);
+		dev->cs_gpio = true;
 	}
 
-out:
-	/* Clear FIFOs, and disable the HW block */
-	spin_lock_irqsave(&bs->cspol_lock, flags);
-	bcm2835_wr(bs, BCM2835_SPI_CS,
-		BCM2835_SPI_CS_CLEAR_RX
-		| BCM2835_SPI_CS_CLEAR_TX
-		| bs->cspol );
-	spin_unlock_irqrestore(&bs->cspol_lock, flags);
+	dev->assert_reg = NULL;
+	chip = gpiod_to_chip(gpio_to_desc(spi->cs_gpio));
+	if (bs->gpio_regs && chip &&
+	    (!strcmp(chip->label, "pinctrl-bcm2835") ||
+	     !strcmp(chip->label, "bcm2708_gpio"))) {
+		pin = spi->cs_gpio - chip->base;
+		if (pin < BCM2835_GPIO_NUM) {
+			dev->mask = BIT(pin % 32);
+			dev->assert_reg = bs->gpio_regs + 4 * (pin / 32) +
+				((spi->mode & SPI_CS_HIGH) ?
+				 BCM2835_GPIO_GPSET0 : BCM2835_GPIO_GPCLR0);
+			dev->deassert_reg = bs->gpio_regs + 4 * (pin / 32) +
+				((spi->mode & SPI_CS_HIGH) ?
+				 BCM2835_GPIO_GPCLR0 : BCM2835_GPIO_GPSET0);
+		}
+	}
 
-	mesg->status = err;
-	spi_finalize_current_message(master);
+	bcm2835_spi_gpio_cs(spi, false);
 
-	debug_set_low();
 	return 0;
 }
 
+/*
+ * hook into the message queue to measure submission latencies - the
+ * core only sets up its queue when registering the master, but every
+ * device gets set up before it gets added, so no message can have been
+ * submitted yet when the first one gets here (spi_add_device serializes)
+ */
+static void bcm2835_spi_hook_queue(struct spi_master *master)
+{
+	struct bcm2835_spi *bs = spi_master_get_devdata(master);
+
+	if ((bs->polling) || (bs->queue_transfer))
+		return;
+
+	bs->queue_transfer = master->transfer;
+	master->transfer = bcm2835_spi_transfer;
+}
+
 static int bcm2835_spi_setup(struct spi_device *spi)
 {
 	struct bcm2835_spi *bs = spi_master_get_devdata(spi->master);
+	struct bcm2835_spi_dev *dev = spi->controller_state;
 	u32 mask = BCM2835_SPI_CS_CSPOL0 << spi->chip_select;
 	unsigned long flags;
+	u32 tolerance;
+
+	bcm2835_spi_hook_queue(spi->master);
+
+	if (!dev) {
+		dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+		if (!dev)
+			return -ENOMEM;
+		spi->controller_state = dev;
+	}
+
+	/* the device tree overrides the module parameter */
+	dev->speed_tolerance_ppm = speed_tolerance_ppm;
+	of_property_read_u32(spi->dev.of_node, "brcm,speed-tolerance-ppm",
+			     &dev->speed_tolerance_ppm);
+
+	/* scheduling parameters */
+	dev->priority = BCM2835_SPI_PRIO_DEFAULT;
+	of_property_read_u32(spi->dev.of_node, "brcm,priority",
+			     &dev->priority);
+	if (dev->priority >= BCM2835_SPI_PRIO_CLASSES)
+		dev->priority = BCM2835_SPI_PRIO_CLASSES - 1;
+	if (!of_property_read_u32(spi->dev.of_node, "brcm,deadline-us",
+				  &dev->deadline_ns))
+		dev->deadline_ns *= NSEC_PER_USEC;
+
+	/* the LoSSI output hold time - in cycles once it gets used */
+	dev->lossi_hold_ns = 0;
+	of_property_read_u32(spi->dev.of_node, "brcm,lossi-hold-ns",
+			     &dev->lossi_hold_ns);
+	dev->ltoh_clk_hz = 0;
+
+	/* CS timing */
+	dev->cs_setup_ns = 0;
+	of_property_read_u32(spi->dev.of_node, "brcm,cs-setup-ns",
+			     &dev->cs_setup_ns);
+	dev->cs_hold_ns = 0;
+	of_property_read_u32(spi->dev.of_node, "brcm,cs-hold-ns",
+			     &dev->cs_hold_ns);
+	dev->cs_inactive_ns = 0;
+	of_property_read_u32(spi->dev.of_node, "brcm,cs-inactive-ns",
+			     &dev->cs_inactive_ns);
+
+	/* how long this device may wait for the controller to wake up */
+	if ((!dev_pm_qos_request_active(&dev->pm_qos)) &&
+	    (!of_property_read_u32(spi->dev.of_node,
+				   "brcm,latency-tolerance-us", &tolerance)))
+		dev_pm_qos_add_request(bs->master->dev.parent, &dev->pm_qos,
+				       DEV_PM_QOS_LATENCY_TOLERANCE,
+				       min_t(u32, tolerance, S32_MAX));
+
+	if (gpio_is_valid(spi->cs_gpio) && !(spi->mode & SPI_NO_CS))
+		return bcm2835_spi_setup_cs_gpio(spi);
+
+	/* only the native chip-selects have a polarity bit */
+	if (spi->chip_select >= BCM2835_SPI_NUM_CS)
+		return (spi->mode & SPI_NO_CS) ? 0 : -EINVAL;
 
 	spin_lock_irqsave(&bs->cspol_lock, flags);
 
@@ -364,12 +3343,28 @@ static int bcm2835_spi_setup(struct spi_device *spi)
 	return 0;
 }
 
+static void bcm2835_spi_cleanup(struct spi_device *spi)
+{
+	struct bcm2835_spi_dev *dev = spi->controller_state;
+
+	if (!dev)
+		return;
+
+	if (dev->cs_gpio)
+		gpio_free(spi->cs_gpio);
+	if (dev_pm_qos_request_active(&dev->pm_qos))
+		dev_pm_qos_remove_request(&dev->pm_qos);
+	kfree(dev);
+	spi->controller_state = NULL;
+}
+
 static int bcm2835_spi_probe(struct platform_device *pdev)
 {
 	struct spi_master *master;
 	struct bcm2835_spi *bs;
 	struct resource *res;
-	int err;
+	u32 cpu;
+	int i, err;
 
 	debug_set_low();
 	debug_set_low2();
@@ -384,21 +3379,37 @@ static int bcm2835_spi_probe(struct platform_device *pdev)
 	platform_set_drvdata(pdev, master);
 
 	master->mode_bits = BCM2835_SPI_MODE_BITS;
-	master->bits_per_word_mask = SPI_BPW_RANGE_MASK(8,9);
-	master->num_chipselect = 3;
+	master->bits_per_word_mask = SPI_BPW_RANGE_MASK(8, 9)
+		| SPI_BPW_MASK(16) | SPI_BPW_MASK(24) | SPI_BPW_MASK(32);
+	master->num_chipselect = BCM2835_SPI_NUM_CS;
 	master->transfer_one_message = bcm2835_spi_transfer_one;
 	master->setup = bcm2835_spi_setup;
+	master->cleanup = bcm2835_spi_cleanup;
 	master->dev.of_node = pdev->dev.of_node;
 	master->rt = 1;
 
 	bs = spi_master_get_devdata(master);
+	bs->master = master;
+	bs->eng.ops = &bcm2835_spi_engine_ops;
 
 	init_completion(&bs->done);
+	spin_lock_init(&bs->queue_lock);
+	for (i = 0; i < BCM2835_SPI_PRIO_CLASSES; i++)
+		INIT_LIST_HEAD(&bs->prio_queue[i]);
+
+	/* busy-poll mode - the device tree overrides the module parameter */
+	bs->polling_cpu = polling_cpu;
+	of_property_read_u32(pdev->dev.of_node, "brcm,polling-cpu",
+			     (u32 *)&bs->polling_cpu);
+	bs->polling = (bs->polling_cpu >= 0);
+	/* bypass the spi core message queue in this mode */
+	if (bs->polling)
+		master->transfer = bcm2835_spi_poll_transfer;
 
 	res = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	bs->regs = devm_ioremap_resource(&pdev->dev, res);
-	if (IS_ERR(bs->regs)) {
-		err = PTR_ERR(bs->regs);
+	bs->eng.regs = devm_ioremap_resource(&pdev->dev, res);
+	if (IS_ERR(bs->eng.regs)) {
+		err = PTR_ERR(bs->eng.regs);
 		goto out_master_put;
 	}
 
@@ -417,33 +3428,120 @@ static int bcm2835_spi_probe(struct platform_device *pdev)
 	}
 
 	spin_lock_init(&bs->cspol_lock);
+	spin_lock_init(&bs->ts_lock);
+	spin_lock_init(&bs->rec_lock);
+	mutex_init(&bs->pm_lock);
+	mutex_init(&bs->misc_lock);
+	INIT_LIST_HEAD(&bs->rings);
 	bs->cspol=0;
+	bs->ltoh = BCM2835_SPI_LTOH_DEFAULT;
+
+	/* gpio chip-selects fall back to gpiolib if this is not available */
+	bs->gpio_regs = devm_ioremap(&pdev->dev, GPIO_BASE, SZ_4K);
 
 	clk_prepare_enable(bs->clk);
 
-	err = devm_request_irq(&pdev->dev, bs->irq, bcm2835_spi_interrupt, 0,
-				dev_name(&pdev->dev), master);
+	/* follow core clock changes */
+	bs->clk_hz = clk_get_rate(bs->clk);
+	bs->clk_nb.notifier_call = bcm2835_spi_clk_notifier;
+	if (clk_notifier_register(bs->clk, &bs->clk_nb))
+		bs->clk_nb.notifier_call = NULL;
+
+	/* threaded interrupt mode - module parameter or device tree */
+	bs->irq_threaded = threaded_irq ||
+		of_property_read_bool(pdev->dev.of_node, "brcm,threaded-irq");
+	bs->irq_cpu = -1;
+
+	if (bs->irq_threaded)
+		err = devm_request_threaded_irq(&pdev->dev, bs->irq,
+						bcm2835_spi_interrupt_hard,
+						bcm2835_spi_interrupt, 0,
+						dev_name(&pdev->dev), master);
+	else
+		err = devm_request_irq(&pdev->dev, bs->irq,
+				       bcm2835_spi_interrupt, 0,
+				       dev_name(&pdev->dev), master);
 	if (err) {
 		dev_err(&pdev->dev, "could not request IRQ: %d\n", err);
 		goto out_clk_disable;
 	}
 
-	/* initialise the hardware */
-	bcm2835_wr(bs, BCM2835_SPI_CS,
-		bs->cspol
-		| BCM2835_SPI_CS_CLEAR_RX
-		| BCM2835_SPI_CS_CLEAR_TX);
+	/* initialise the hardware - timing a full gating cycle on the way */
+	clk_disable_unprepare(bs->clk);
+	err = bcm2835_spi_wake(bs);
+	if (err) {
+		dev_err(&pdev->dev, "could not enable clk: %d\n", err);
+		goto out_clk_notifier;
+	}
+
+	/*
+	 * the busy-polling thread owns the bus for good, so only gate
+	 * the clock when the spi core runs the messages
+	 */
+	bs->pm_tolerance_us = PM_QOS_LATENCY_TOLERANCE_NO_CONSTRAINT;
+	pdev->dev.power.set_latency_tolerance =
+		bcm2835_spi_set_latency_tolerance;
+	if (!bs->polling) {
+		master->auto_runtime_pm = true;
+		bs->pm_delay_ms = autosuspend_ms;
+		pm_runtime_set_autosuspend_delay(&pdev->dev, autosuspend_ms);
+		pm_runtime_use_autosuspend(&pdev->dev);
+		pm_runtime_set_active(&pdev->dev);
+		pm_runtime_enable(&pdev->dev);
+	}
+	if (dev_pm_qos_expose_latency_tolerance(&pdev->dev))
+		dev_warn(&pdev->dev, "could not expose latency tolerance\n");
+
+	if (bs->polling) {
+		err = bcm2835_spi_start_poll_thread(pdev, master);
+		if (err)
+			goto out_pm_disable;
+	}
+
+	err = sysfs_create_group(&pdev->dev.kobj, &bcm2835_spi_attr_group);
+	if (err)
+		goto out_poll_stop;
 
 	err = devm_spi_register_master(&pdev->dev, master);
 	if (err) {
 		dev_err(&pdev->dev, "could not register SPI master: %d\n", err);
-		goto out_clk_disable;
+		goto out_sysfs_remove;
+	}
+
+	/* in case no device got added on registration */
+	bcm2835_spi_hook_queue(master);
+
+	/* the message pump only exists now */
+	if (!of_property_read_u32(pdev->dev.of_node, "brcm,irq-cpu", &cpu)) {
+		err = bcm2835_spi_set_irq_cpu(master, cpu);
+		if (err)
+			dev_warn(&pdev->dev, "could not move irq to cpu %u: %d\n",
+				 cpu, err);
 	}
 
+	bcm2835_spi_register_misc(pdev, &bs->ring_misc, bs->ring_name,
+				  sizeof(bs->ring_name), "ring",
+				  &bcm2835_spi_ring_fops);
+	bcm2835_spi_register_misc(pdev, &bs->stream_misc, bs->stream_name,
+				  sizeof(bs->stream_name), "stream",
+				  &bcm2835_spi_stream_fops);
+
 	return 0;
 
+out_sysfs_remove:
+	sysfs_remove_group(&pdev->dev.kobj, &bcm2835_spi_attr_group);
+out_poll_stop:
+	if (bs->poll_task)
+		kthread_stop(bs->poll_task);
+out_pm_disable:
+	dev_pm_qos_hide_latency_tolerance(&pdev->dev);
+	pm_runtime_disable(&pdev->dev);
+	pm_runtime_set_suspended(&pdev->dev);
 out_clk_disable:
 	clk_disable_unprepare(bs->clk);
+out_clk_notifier:
+	if (bs->clk_nb.notifier_call)
+		clk_notifier_unregister(bs->clk, &bs->clk_nb);
 out_master_put:
 	spi_master_put(master);
 	return err;
@@ -454,12 +3552,42 @@ static int bcm2835_spi_remove(struct platform_device *pdev)
 	struct spi_master *master = platform_get_drvdata(pdev);
 	struct bcm2835_spi *bs = spi_master_get_devdata(master);
 
+	sysfs_remove_group(&pdev->dev.kobj, &bcm2835_spi_attr_group);
+
+	if (bs->stream_misc.name)
+		misc_deregister(&bs->stream_misc);
+	if (bs->ring_misc.name)
+		misc_deregister(&bs->ring_misc);
+	bcm2835_spi_revoke_misc(bs);
+
+	/* stop the polling thread and fail any pending messages */
+	bs->stopping = true;
+	if (bs->poll_task)
+		kthread_stop(bs->poll_task);
+
+	/* the block may be gated right now */
+	dev_pm_qos_hide_latency_tolerance(&pdev->dev);
+	pm_runtime_get_sync(&pdev->dev);
+
 	/* Clear FIFOs, and disable the HW block */
 	bcm2835_wr(bs, BCM2835_SPI_CS,
 		   BCM2835_SPI_CS_CLEAR_RX | BCM2835_SPI_CS_CLEAR_TX);
 
+	pm_runtime_disable(&pdev->dev);
+	pm_runtime_put_noidle(&pdev->dev);
+	pm_runtime_set_suspended(&pdev->dev);
+
+	if (bs->clk_nb.notifier_call)
+		clk_notifier_unregister(bs->clk, &bs->clk_nb);
 	clk_disable_unprepare(bs->clk);
 
+	vfree(bs->rec_buf);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
+	/* devm frees the irq, which must not keep a hint */
+	irq_set_affinity_hint(bs->irq, NULL);
+#endif
+
 	return 0;
 }
 
@@ -470,11 +3598,17 @@ static const struct of_device_id bcm2835_spi_match[] = {
 };
 MODULE_DEVICE_TABLE(of, bcm2835_spi_match);
 
+static const struct dev_pm_ops bcm2835_spi_pm_ops = {
+	SET_RUNTIME_PM_OPS(bcm2835_spi_runtime_suspend,
+			   bcm2835_spi_runtime_resume, NULL)
+};
+
 static struct platform_driver bcm2835_spi_driver = {
 	.driver		= {
 		.name		= DRV_NAME,
 		.owner		= THIS_MODULE,
 		.of_match_table	= bcm2835_spi_match,
+		.pm		= &bcm2835_spi_pm_ops,
 	},
 	.probe		= bcm2835_spi_probe,
 	.remove		= bcm2835_spi_remove,
@@ -0,0 +1,128 @@
+/*
+ * In-kernel client interface of the Broadcom BCM2835 SPI driver
+ *
+ * Copyright (C) 2015 Martin Sperl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __SPI_BCM2835_H
+#define __SPI_BCM2835_H
+
+#include <linux/spi/spi.h>
+
+/**
+ * struct bcm2835_spi_batch - messages to run back to back
+ * @msgs: the messages - each with ->spi set to its device,
+ *	all devices need to be on the same bus
+ * @count: the number of messages
+ * @complete: called once all messages have been run,
+ *	the individual ->complete callbacks are not called,
+ *	but ->status and ->actual_length of each message get set
+ * @context: the argument to @complete
+ * @errors: the number of messages that failed
+ * @carrier: private - the message representing the batch in the queue
+ */
+struct bcm2835_spi_batch {
+	struct spi_message **msgs;
+	unsigned int count;
+	void (*complete)(void *context);
+	void *context;
+	unsigned int errors;
+	struct spi_message carrier;
+};
+
+extern int bcm2835_spi_batch_async(struct bcm2835_spi_batch *batch);
+extern int bcm2835_spi_batch_sync(struct bcm2835_spi_batch *batch);
+
+/**
+ * struct bcm2835_spi_poll - repeat a message until its response matches
+ * @msg: the command/response message - with ->spi set
+ * @match: points to the response bytes to test (in an rx_buf of @msg)
+ * @match_len: the number of response bytes (1 to 4) - MSB first
+ * @mask: the bits of the response to test
+ * @value: stop polling once (response & @mask) == @value
+ * @interval_us: the delay between two polls - busy-waited only when short
+ * @timeout_us: give up after this time (0 = no limit)
+ * @max_polls: give up after this many polls (0 = no limit) - at least
+ *	one of @timeout_us and @max_polls needs to be set
+ * @complete: called once polling has finished, @msg->complete is not
+ * @context: the argument to @complete
+ * @polls: the number of polls run
+ * @status: 0 on match, -ETIMEDOUT or the error of @msg otherwise
+ * @carrier: private - the message representing the poll in the queue
+ */
+struct bcm2835_spi_poll {
+	struct spi_message *msg;
+	const u8 *match;
+	unsigned int match_len;
+	u32 mask;
+	u32 value;
+	unsigned int interval_us;
+	unsigned int timeout_us;
+	unsigned int max_polls;
+	void (*complete)(void *context);
+	void *context;
+	unsigned int polls;
+	int status;
+	struct spi_message carrier;
+};
+
+extern int bcm2835_spi_poll_async(struct bcm2835_spi_poll *poll);
+extern int bcm2835_spi_poll_sync(struct bcm2835_spi_poll *poll);
+
+/* the number of transfers per message that get timestamped */
+#define BCM2835_SPI_MAX_TIMESTAMPS 8
+
+/**
+ * struct bcm2835_spi_timestamp - when a transfer was on the wire
+ * @start_ns: SCK started within [@start_ns, @start_ns + @start_err_ns]
+ * @end_ns: the last bit left within [@end_ns - @end_err_ns, @end_ns]
+ * @start_err_ns: the uncertainty of @start_ns
+ * @end_err_ns: the uncertainty of @end_ns
+ *
+ * all times are CLOCK_MONOTONIC as returned by ktime_get_ns()
+ */
+struct bcm2835_spi_timestamp {
+	u64 start_ns;
+	u64 end_ns;
+	u32 start_err_ns;
+	u32 end_err_ns;
+};
+
+extern int bcm2835_spi_message_timestamps(struct spi_message *mesg,
+		struct bcm2835_spi_timestamp *ts, unsigned int count);
+
+/*
+ * LoSSI (9 bit) transfers carry one u16 per word in memory,
+ * bit 8 set for data/parameters and clear for commands
+ */
+#define BCM2835_SPI_LOSSI_CMD(c)	((u16)(u8)(c))
+#define BCM2835_SPI_LOSSI_DATA(d)	((u16)(0x100 | (u8)(d)))
+
+/**
+ * bcm2835_spi_lossi_pack - tag a run of bytes as LoSSI data words
+ * @dst: room for @len words
+ * @src: the data bytes
+ * @len: the number of bytes
+ */
+static inline void bcm2835_spi_lossi_pack(u16 *dst, const u8 *src,
+		size_t len)
+{
+	while (len--)
+		*dst++ = BCM2835_SPI_LOSSI_DATA(*src++);
+}
+
+#endif /* __SPI_BCM2835_H */
@@ -0,0 +1,553 @@
+/*
+ * streaming analyzer for logic analyzer csv exports (Saleae style)
+ * of spi-bcm2835/spi-bcm2708 captures
+ *
+ * decodes SCK/MOSI/MISO/CS and the debug-pin channels and reports
+ * per message: CS to first clock, inter-byte gaps, inter-transfer gaps,
+ * irq to worker latency and effective vs. nominal clock
+ * as well as the time spent in transfer_one
+ *
+ * only aggregates are kept in memory, so multi-million sample files
+ * are no problem
+ *
+ * Copyright (C) 2015 Martin Sperl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <ctype.h>
+#include <float.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* the channels we know about and their default column names */
+enum {
+	CH_SCK,
+	CH_MOSI,
+	CH_MISO,
+	CH_CS,
+	CH_MSG,		/* debugpin1 - transfer_one */
+	CH_WAIT,	/* debugpin2 - waiting for the completion */
+	CH_IRQ,		/* debugpin3 - the interrupt handler */
+	CH_NUM
+};
+
+static const char *ch_name[CH_NUM] = {
+	"SCK", "MOSI", "MISO", "CS", "DEBUG1", "DEBUG2", "DEBUG3"
+};
+
+/* the number of data bytes shown per message */
+#define SHOW_BYTES 16
+
+struct la_stat {
+	unsigned long n;
+	double min;
+	double max;
+	double sum;
+};
+
+static void stat_add(struct la_stat *s, double v)
+{
+	if ((!s->n) || (v < s->min))
+		s->min = v;
+	if ((!s->n) || (v > s->max))
+		s->max = v;
+	s->sum += v;
+	s->n++;
+}
+
+static double stat_avg(const struct la_stat *s)
+{
+	return s->n ? s->sum / s->n : 0.0;
+}
+
+struct msg {
+	int active;
+	unsigned long number;
+	double start;
+	double end;
+	double first_clk;
+	double last_clk;
+	unsigned long bits;
+	unsigned char mosi;
+	unsigned char miso;
+	unsigned char mosi_bytes[SHOW_BYTES];
+	unsigned char miso_bytes[SHOW_BYTES];
+	struct la_stat period;
+	struct la_stat byte_gap;
+	struct la_stat xfer_gap;
+	struct la_stat irq_lat;
+};
+
+/* the totals over all messages */
+struct summary {
+	unsigned long messages;
+	unsigned long bytes;
+	struct la_stat cs_to_clk;
+	struct la_stat byte_gap;
+	struct la_stat xfer_gap;
+	struct la_stat msg_gap;
+	struct la_stat irq_lat;
+	struct la_stat pump;
+	struct la_stat duration;
+	struct la_stat eff_hz;
+	struct la_stat nom_hz;
+};
+
+static struct {
+	int col[CH_NUM];
+	int cs_active_high;
+	int sample_rising;
+	double idle_s;
+	double xfer_gap_s;
+	double nominal_hz;
+	FILE *json;
+	int quiet;
+} cfg = {
+	.idle_s = 50e-6,
+	.xfer_gap_s = 2e-6,
+	.sample_rising = 1,
+};
+
+static struct summary sum;
+static struct msg cur;
+static double prev_msg_end = -DBL_MAX;
+static double irq_exit = -DBL_MAX;
+static double pump_entry = -DBL_MAX;
+
+static void json_stat(FILE *f, const char *name, const struct la_stat *s,
+		      double scale)
+{
+	fprintf(f, ",\"%s\":{\"n\":%lu", name, s->n);
+	if (s->n)
+		fprintf(f, ",\"min\":%.3f,\"avg\":%.3f,\"max\":%.3f",
+			s->min * scale, stat_avg(s) * scale, s->max * scale);
+	fputc('}', f);
+}
+
+static void json_hex(FILE *f, const char *name, const unsigned char *b,
+		     unsigned long n)
+{
+	unsigned long i;
+
+	fprintf(f, ",\"%s\":\"", name);
+	for (i = 0; (i < n) && (i < SHOW_BYTES); i++)
+		fprintf(f, "%02x", b[i]);
+	fputc('"', f);
+}
+
+static void msg_start(double t)
+{
+	memset(&cur, 0, sizeof(cur));
+	cur.active = 1;
+	cur.number = sum.messages;
+	cur.start = t;
+	cur.first_clk = -1.0;
+}
+
+static void msg_finish(double t)
+{
+	unsigned long bytes = cur.bits / 8;
+	double eff_hz = 0.0, nom_hz = 0.0, span;
+
+	if (!cur.active)
+		return;
+	cur.active = 0;
+	cur.end = t;
+
+	/* CS toggling without any clocks */
+	if (!cur.bits)
+		return;
+
+	sum.messages++;
+	sum.bytes += bytes;
+
+	if (cur.period.n) {
+		nom_hz = 1.0 / stat_avg(&cur.period);
+		span = cur.last_clk - cur.first_clk + stat_avg(&cur.period);
+		eff_hz = cur.bits / span;
+		stat_add(&sum.eff_hz, eff_hz);
+		stat_add(&sum.nom_hz, nom_hz);
+	}
+	/* without a CS channel the first clock starts the message */
+	if ((cfg.col[CH_CS] >= 0) && (cur.first_clk >= cur.start))
+		stat_add(&sum.cs_to_clk, cur.first_clk - cur.start);
+	if (prev_msg_end > -DBL_MAX)
+		stat_add(&sum.msg_gap, cur.start - prev_msg_end);
+	prev_msg_end = cur.end;
+	stat_add(&sum.duration, cur.end - cur.start);
+
+	if (!cfg.json)
+		return;
+
+	fprintf(cfg.json, "%s\n  {\"msg\":%lu,\"start_s\":%.9f",
+		cur.number ? "," : "", cur.number, cur.start);
+	fprintf(cfg.json, ",\"duration_us\":%.3f,\"bits\":%lu,\"bytes\":%lu",
+		(cur.end - cur.start) * 1e6, cur.bits, bytes);
+	if (cfg.col[CH_CS] >= 0)
+		fprintf(cfg.json, ",\"cs_to_clk_us\":%.3f",
+			(cur.first_clk - cur.start) * 1e6);
+	json_stat(cfg.json, "byte_gap_us", &cur.byte_gap, 1e6);
+	json_stat(cfg.json, "xfer_gap_us", &cur.xfer_gap, 1e6);
+	json_stat(cfg.json, "irq_latency_us", &cur.irq_lat, 1e6);
+	fprintf(cfg.json, ",\"effective_hz\":%.0f,\"nominal_hz\":%.0f",
+		eff_hz, nom_hz);
+	if (cfg.col[CH_MOSI] >= 0)
+		json_hex(cfg.json, "mosi", cur.mosi_bytes, bytes);
+	if (cfg.col[CH_MISO] >= 0)
+		json_hex(cfg.json, "miso", cur.miso_bytes, bytes);
+	fputc('}', cfg.json);
+}
+
+/* a sampling edge of SCK */
+static void sample(double t, const int *val)
+{
+	unsigned long bit;
+	double dt, gap, period;
+
+	if (!cur.active) {
+		/* without a CS channel clocks start the message */
+		if (cfg.col[CH_CS] >= 0)
+			return;
+		msg_start(t);
+	} else if ((cfg.col[CH_CS] < 0) && (cur.bits) &&
+		   (t - cur.last_clk > cfg.idle_s)) {
+		msg_finish(cur.last_clk);
+		msg_start(t);
+	}
+
+	if (cur.first_clk < 0.0)
+		cur.first_clk = t;
+
+	bit = cur.bits % 8;
+	if (cur.bits) {
+		dt = t - cur.last_clk;
+		period = cur.period.n ? stat_avg(&cur.period) : dt;
+		gap = dt > period ? dt - period : 0.0;
+		/* slow clocks must not look like gaps */
+		if ((dt > cfg.xfer_gap_s) && (dt > 3 * period)) {
+			stat_add(&cur.xfer_gap, gap);
+			stat_add(&sum.xfer_gap, gap);
+		} else if (bit) {
+			stat_add(&cur.period, dt);
+		} else {
+			stat_add(&cur.byte_gap, gap);
+			stat_add(&sum.byte_gap, gap);
+		}
+	}
+
+	cur.mosi = (cur.mosi << 1) | (val[CH_MOSI] > 0);
+	cur.miso = (cur.miso << 1) | (val[CH_MISO] > 0);
+	if ((bit == 7) && (cur.bits / 8 < SHOW_BYTES)) {
+		cur.mosi_bytes[cur.bits / 8] = cur.mosi;
+		cur.miso_bytes[cur.bits / 8] = cur.miso;
+	}
+
+	cur.last_clk = t;
+	cur.bits++;
+}
+
+static void edge(int ch, double t, int val, const int *vals)
+{
+	switch (ch) {
+	case CH_SCK:
+		if (val == cfg.sample_rising)
+			sample(t, vals);
+		break;
+	case CH_CS:
+		if (val == cfg.cs_active_high)
+			msg_start(t);
+		else
+			msg_finish(t);
+		break;
+	case CH_MSG:
+		/* the time spent in transfer_one */
+		if (val)
+			pump_entry = t;
+		else if (pump_entry > -DBL_MAX)
+			stat_add(&sum.pump, t - pump_entry);
+		break;
+	case CH_IRQ:
+		/* the handler has called complete() */
+		if (!val)
+			irq_exit = t;
+		break;
+	case CH_WAIT:
+		/* the worker is back from wait_for_completion() */
+		if ((!val) && (irq_exit > -DBL_MAX)) {
+			stat_add(&sum.irq_lat, t - irq_exit);
+			if (cur.active)
+				stat_add(&cur.irq_lat, t - irq_exit);
+			irq_exit = -DBL_MAX;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static char *trim(char *s)
+{
+	char *e;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	e = s + strlen(s);
+	while ((e > s) && isspace((unsigned char)e[-1]))
+		*--e = 0;
+	return s;
+}
+
+/* channels without a fixed column get looked up by name, -1 if absent */
+static void parse_header(char *line)
+{
+	char *tok, *save = NULL;
+	int fixed[CH_NUM];
+	int col, ch;
+
+	for (ch = 0; ch < CH_NUM; ch++) {
+		fixed[ch] = cfg.col[ch];
+		if (!fixed[ch])
+			cfg.col[ch] = -1;
+	}
+
+	for (col = 0, tok = strtok_r(line, ",", &save); tok;
+	     col++, tok = strtok_r(NULL, ",", &save)) {
+		tok = trim(tok);
+		for (ch = 0; ch < CH_NUM; ch++)
+			if ((!fixed[ch]) && (cfg.col[ch] < 0) &&
+			    !strcasecmp(tok, ch_name[ch]))
+				cfg.col[ch] = col;
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] [capture.csv]\n"
+		"  --sck/--mosi/--miso/--cs/--msg/--wait/--irq=NAME|COLUMN\n"
+		"        the csv column of each channel (defaults: SCK MOSI MISO\n"
+		"        CS DEBUG1 DEBUG2 DEBUG3 - the debug pins of the driver)\n"
+		"  --mode=N          spi mode, selects the sampling edge (0)\n"
+		"  --cs-high         CS is active high\n"
+		"  --idle-us=US      without CS: idle time ending a message (50)\n"
+		"  --xfer-gap-us=US  clock gaps (of more than 3 bits) counted\n"
+		"                    as transfer gaps (2)\n"
+		"  --nominal-hz=HZ   the requested clock to compare against\n"
+		"  --json=FILE       write per message metrics and the summary\n"
+		"  --quiet           no summary table\n", prog);
+	exit(2);
+}
+
+/* a channel is given either by its column number or its name */
+static void set_channel(int ch, const char *arg)
+{
+	char *end;
+	long col = strtol(arg, &end, 10);
+
+	if ((*arg) && (!*end) && (col > 0)) {
+		cfg.col[ch] = col;
+	} else {
+		ch_name[ch] = arg;
+		cfg.col[ch] = 0;
+	}
+}
+
+static void print_stat(const char *name, const struct la_stat *s, double scale,
+		       const char *unit)
+{
+	if (!s->n) {
+		printf("%-24s %10s\n", name, "-");
+		return;
+	}
+	printf("%-24s %10lu %12.3f %12.3f %12.3f %s\n", name, s->n,
+	       s->min * scale, stat_avg(s) * scale, s->max * scale, unit);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "sck", required_argument, NULL, CH_SCK },
+		{ "mosi", required_argument, NULL, CH_MOSI },
+		{ "miso", required_argument, NULL, CH_MISO },
+		{ "cs", required_argument, NULL, CH_CS },
+		{ "msg", required_argument, NULL, CH_MSG },
+		{ "wait", required_argument, NULL, CH_WAIT },
+		{ "irq", required_argument, NULL, CH_IRQ },
+		{ "mode", required_argument, NULL, 'm' },
+		{ "cs-high", no_argument, NULL, 'H' },
+		{ "idle-us", required_argument, NULL, 'i' },
+		{ "xfer-gap-us", required_argument, NULL, 'g' },
+		{ "nominal-hz", required_argument, NULL, 'n' },
+		{ "json", required_argument, NULL, 'j' },
+		{ "quiet", no_argument, NULL, 'q' },
+		{ NULL, 0, NULL, 0 }
+	};
+	char line[4096], *tok, *save;
+	int val[CH_NUM], old[CH_NUM];
+	unsigned long rows = 0;
+	FILE *in = stdin;
+	int opt, ch, col, mode;
+	double t = 0.0;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'm':
+			mode = atoi(optarg) & 3;
+			/* modes 0 and 3 sample on the rising edge */
+			cfg.sample_rising = ((mode >> 1) == (mode & 1));
+			break;
+		case 'H':
+			cfg.cs_active_high = 1;
+			break;
+		case 'i':
+			cfg.idle_s = atof(optarg) * 1e-6;
+			break;
+		case 'g':
+			cfg.xfer_gap_s = atof(optarg) * 1e-6;
+			break;
+		case 'n':
+			cfg.nominal_hz = atof(optarg);
+			break;
+		case 'j':
+			cfg.json = fopen(optarg, "w");
+			if (!cfg.json) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		case 'q':
+			cfg.quiet = 1;
+			break;
+		default:
+			if ((opt >= 0) && (opt < CH_NUM))
+				set_channel(opt, optarg);
+			else
+				usage(argv[0]);
+		}
+	}
+	if (optind < argc - 1)
+		usage(argv[0]);
+	if (optind == argc - 1) {
+		in = fopen(argv[optind], "r");
+		if (!in) {
+			perror(argv[optind]);
+			return 1;
+		}
+	}
+
+	if (!fgets(line, sizeof(line), in)) {
+		fprintf(stderr, "empty input\n");
+		return 1;
+	}
+	parse_header(line);
+	if (cfg.col[CH_SCK] < 0) {
+		fprintf(stderr, "no %s column found\n", ch_name[CH_SCK]);
+		return 1;
+	}
+
+	for (ch = 0; ch < CH_NUM; ch++)
+		old[ch] = val[ch] = -1;
+
+	if (cfg.json)
+		fprintf(cfg.json, "{\"messages\":[");
+
+	while (fgets(line, sizeof(line), in)) {
+		int row[CH_NUM];
+
+		for (ch = 0; ch < CH_NUM; ch++)
+			row[ch] = -1;
+		save = NULL;
+		for (col = 0, tok = strtok_r(line, ",", &save); tok;
+		     col++, tok = strtok_r(NULL, ",", &save)) {
+			if (!col) {
+				t = strtod(tok, NULL);
+				continue;
+			}
+			for (ch = 0; ch < CH_NUM; ch++)
+				if (cfg.col[ch] == col)
+					row[ch] = atoi(tok) != 0;
+		}
+		rows++;
+
+		/* data lines first, so edges see the current levels */
+		for (ch = 0; ch < CH_NUM; ch++) {
+			old[ch] = val[ch];
+			val[ch] = row[ch];
+		}
+		/* CS first so a message exists for a clock at the same time */
+		if ((old[CH_CS] >= 0) && (val[CH_CS] != old[CH_CS]) &&
+		    (val[CH_CS] == cfg.cs_active_high))
+			edge(CH_CS, t, val[CH_CS], val);
+		for (ch = 0; ch < CH_NUM; ch++) {
+			if ((old[ch] < 0) || (val[ch] == old[ch]))
+				continue;
+			if ((ch == CH_CS) && (val[ch] == cfg.cs_active_high))
+				continue;
+			edge(ch, t, val[ch], val);
+		}
+		/* a capture starting with CS asserted */
+		if ((rows == 1) && (val[CH_CS] == cfg.cs_active_high))
+			msg_start(t);
+	}
+	msg_finish(cur.active && cfg.col[CH_CS] < 0 ? cur.last_clk : t);
+
+	if (cfg.json) {
+		fprintf(cfg.json, "\n],\"summary\":{\"rows\":%lu", rows);
+		fprintf(cfg.json, ",\"messages\":%lu,\"bytes\":%lu",
+			sum.messages, sum.bytes);
+		if (cfg.col[CH_CS] >= 0)
+			json_stat(cfg.json, "cs_to_clk_us", &sum.cs_to_clk,
+				  1e6);
+		json_stat(cfg.json, "byte_gap_us", &sum.byte_gap, 1e6);
+		json_stat(cfg.json, "xfer_gap_us", &sum.xfer_gap, 1e6);
+		json_stat(cfg.json, "msg_gap_us", &sum.msg_gap, 1e6);
+		json_stat(cfg.json, "irq_latency_us", &sum.irq_lat, 1e6);
+		json_stat(cfg.json, "transfer_one_us", &sum.pump, 1e6);
+		json_stat(cfg.json, "duration_us", &sum.duration, 1e6);
+		json_stat(cfg.json, "effective_hz", &sum.eff_hz, 1.0);
+		json_stat(cfg.json, "nominal_hz", &sum.nom_hz, 1.0);
+		if (cfg.nominal_hz > 0.0)
+			fprintf(cfg.json, ",\"requested_hz\":%.0f",
+				cfg.nominal_hz);
+		fprintf(cfg.json, "}}\n");
+		fclose(cfg.json);
+	}
+
+	if (cfg.quiet)
+		return 0;
+
+	printf("%lu rows, %lu messages, %lu bytes\n\n",
+	       rows, sum.messages, sum.bytes);
+	printf("%-24s %10s %12s %12s %12s\n", "metric", "count",
+	       "min", "avg", "max");
+	if (cfg.col[CH_CS] >= 0)
+		print_stat("cs to first clock", &sum.cs_to_clk, 1e6, "us");
+	print_stat("inter-byte gap", &sum.byte_gap, 1e6, "us");
+	print_stat("inter-transfer gap", &sum.xfer_gap, 1e6, "us");
+	print_stat("inter-message gap", &sum.msg_gap, 1e6, "us");
+	print_stat("irq to worker", &sum.irq_lat, 1e6, "us");
+	print_stat("transfer_one", &sum.pump, 1e6, "us");
+	print_stat("message duration", &sum.duration, 1e6, "us");
+	print_stat("effective clock", &sum.eff_hz, 1e-6, "MHz");
+	print_stat("nominal clock", &sum.nom_hz, 1e-6, "MHz");
+	if ((cfg.nominal_hz > 0.0) && sum.eff_hz.n)
+		printf("\neffective/requested clock: %.3f\n",
+		       stat_avg(&sum.eff_hz) / cfg.nominal_hz);
+	if (cfg.col[CH_CS] < 0)
+		printf("\nno CS channel: messages are split at idle clocks, "
+		       "cs to first clock is not measured\n");
+
+	return 0;
+}
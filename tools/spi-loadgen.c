@@ -0,0 +1,609 @@
+/*
+ * multi-threaded load generator for spi-bcm2835
+ *
+ * runs concurrent jobs against spidev devices (synchronous ioctls)
+ * or the ring device of the driver (asynchronous, several messages
+ * in flight) and reports latency percentiles from log-linear
+ * (HDR style) histograms, throughput and cpu utilization
+ *
+ * with MOSI tied to MISO the loopback mode checks every byte received
+ *
+ * Copyright (C) 2015 Martin Sperl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/spi/spidev.h>
+
+#include "../spi-bcm2835-ring.h"
+
+#define MAX_JOBS	16
+#define MAX_SPEEDS	8
+
+/*
+ * log-linear histogram: 2^HIST_SUB_BITS buckets per power of 2,
+ * so every value is recorded with a relative error below 1/32
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS	(64 * HIST_SUB)
+
+struct hist {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t n;
+	uint64_t max;
+};
+
+struct job {
+	char dev[64];
+	int threads;
+	unsigned int min_size;
+	unsigned int max_size;
+	double rate;		/* per thread, 0 = as fast as possible */
+	uint32_t speeds[MAX_SPEEDS];
+	int nspeeds;
+	int depth;		/* > 0: async through the ring device */
+	int cs;
+	int bpw;
+	int loopback;
+};
+
+struct worker {
+	pthread_t thread;
+	struct job *job;
+	unsigned int seed;
+	struct hist hist;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t mismatches;
+};
+
+static struct job jobs[MAX_JOBS];
+static int njobs;
+static volatile sig_atomic_t stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ull,
+		.tv_nsec = ns % 1000000000ull,
+	};
+
+	while ((clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+		== EINTR) && !stop)
+		;
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < HIST_SUB)
+		return v;
+	e = 63 - __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+		((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* the lowest value of a bucket */
+static uint64_t hist_value(unsigned int idx)
+{
+	unsigned int k = idx / HIST_SUB, sub = idx % HIST_SUB;
+
+	if (!k)
+		return idx;
+	return (uint64_t)(HIST_SUB + sub) << (k - 1);
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	h->count[hist_index(v)]++;
+	h->n++;
+	if (v > h->max)
+		h->max = v;
+}
+
+static void hist_merge(struct hist *to, const struct hist *from)
+{
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->count[i] += from->count[i];
+	to->n += from->n;
+	if (from->max > to->max)
+		to->max = from->max;
+}
+
+static uint64_t hist_percentile(const struct hist *h, double p)
+{
+	uint64_t want = h->n * p / 100.0, seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->count[i];
+		if (seen > want)
+			return hist_value(i);
+	}
+	return h->max;
+}
+
+/* the bytes per word in memory */
+static unsigned int word_size(int bpw)
+{
+	return bpw > 16 ? 4 : bpw > 8 ? 2 : 1;
+}
+
+static unsigned int round_words(unsigned int len, int bpw)
+{
+	unsigned int word = word_size(bpw);
+
+	return (len + word - 1) & ~(word - 1);
+}
+
+/* whole words only - max_size is rounded up, so at least one fits */
+static unsigned int pick_len(struct worker *w)
+{
+	struct job *job = w->job;
+	unsigned int len = job->min_size;
+
+	if (job->max_size > job->min_size)
+		len += rand_r(&w->seed) % (job->max_size - job->min_size + 1);
+
+	return round_words(len, job->bpw);
+}
+
+static void fill_tx(struct worker *w, uint8_t *tx, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		tx[i] = rand_r(&w->seed);
+}
+
+static void check_rx(struct worker *w, const uint8_t *tx, const uint8_t *rx,
+		     unsigned int len)
+{
+	if (w->job->loopback && memcmp(tx, rx, len))
+		w->mismatches++;
+}
+
+/* the start time of the next operation when running at a fixed rate */
+static uint64_t pace(struct worker *w, uint64_t *next)
+{
+	uint64_t now;
+
+	if (w->job->rate <= 0.0)
+		return now_ns();
+
+	now = *next;
+	*next += 1e9 / w->job->rate;
+	sleep_until(now);
+	/*
+	 * latencies count from the intended start, so a stalled bus
+	 * shows up in the tail instead of just slowing us down
+	 */
+	return now;
+}
+
+static void *sync_worker(void *data)
+{
+	struct worker *w = data;
+	struct job *job = w->job;
+	struct spi_ioc_transfer xfer;
+	uint8_t *tx, *rx;
+	uint64_t start, next = now_ns();
+	unsigned int len;
+	int fd;
+
+	fd = open(job->dev, O_RDWR);
+	tx = malloc(job->max_size);
+	rx = malloc(job->max_size);
+	if ((fd < 0) || (!tx) || (!rx)) {
+		perror(job->dev);
+		w->errors++;
+		return NULL;
+	}
+	fill_tx(w, tx, job->max_size);
+
+	while (!stop) {
+		len = pick_len(w);
+		if (job->loopback)
+			fill_tx(w, tx, len);
+
+		memset(&xfer, 0, sizeof(xfer));
+		xfer.tx_buf = (uintptr_t)tx;
+		xfer.rx_buf = (uintptr_t)rx;
+		xfer.len = len;
+		xfer.speed_hz = job->speeds[w->ops % job->nspeeds];
+		xfer.bits_per_word = job->bpw;
+
+		start = pace(w, &next);
+		if (stop)
+			break;
+		if (ioctl(fd, SPI_IOC_MESSAGE(1), &xfer) < 0) {
+			w->errors++;
+			continue;
+		}
+		hist_add(&w->hist, now_ns() - start);
+		check_rx(w, tx, rx, len);
+		w->ops++;
+		w->bytes += len;
+	}
+
+	close(fd);
+	free(tx);
+	free(rx);
+	return NULL;
+}
+
+/* one data slot per message in flight - tx followed by rx */
+struct ring_slot {
+	uint64_t start;
+	unsigned int len;
+};
+
+static void *ring_worker(void *data)
+{
+	struct worker *w = data;
+	struct job *job = w->job;
+	struct bcm2835_spi_ring_setup setup = {
+		.sq_entries = job->depth,
+		.cq_entries = job->depth,
+		.data_size = 2 * job->max_size * job->depth,
+	};
+	struct bcm2835_spi_ring_hdr *hdr;
+	struct bcm2835_spi_ring_sqe *sqes, *sqe;
+	struct bcm2835_spi_ring_cqe *cqes, *cqe;
+	struct ring_slot *slots;
+	int *free_slots, nfree;
+	uint8_t *map, *buf;
+	uint32_t sq_tail, cq_head, cq_tail;
+	uint64_t start, next = now_ns();
+	struct pollfd pfd;
+	unsigned int len;
+	int fd, slot, busy;
+
+	fd = open(job->dev, O_RDWR);
+	if ((fd < 0) || ioctl(fd, BCM2835_SPI_RING_IOC_SETUP, &setup)) {
+		perror(job->dev);
+		w->errors++;
+		return NULL;
+	}
+	map = mmap(NULL, setup.map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		   fd, 0);
+	slots = calloc(job->depth, sizeof(*slots));
+	free_slots = calloc(job->depth, sizeof(*free_slots));
+	if ((map == MAP_FAILED) || (!slots) || (!free_slots)) {
+		perror("ring setup");
+		w->errors++;
+		return NULL;
+	}
+	hdr = (void *)map;
+	sqes = (void *)(map + setup.sq_offset);
+	cqes = (void *)(map + setup.cq_offset);
+	for (nfree = 0; nfree < job->depth; nfree++)
+		free_slots[nfree] = nfree;
+
+	sq_tail = hdr->sq.tail;
+	cq_head = hdr->cq.head;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while ((!stop) || (nfree < job->depth)) {
+		busy = 0;
+
+		/* submit while there is room and the rate allows it */
+		while ((!stop) && nfree &&
+		       ((job->rate <= 0.0) || (now_ns() >= next))) {
+			slot = free_slots[--nfree];
+			buf = map + setup.data_offset + 2 * job->max_size * slot;
+			len = pick_len(w);
+			if (job->loopback)
+				fill_tx(w, buf, len);
+
+			sqe = &sqes[sq_tail & (setup.sq_entries - 1)];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->tx_offset = 2 * job->max_size * slot;
+			sqe->rx_offset = sqe->tx_offset + job->max_size;
+			sqe->len = len;
+			sqe->speed_hz = job->speeds[w->ops % job->nspeeds];
+			sqe->chip_select = job->cs;
+			sqe->bits_per_word = job->bpw;
+			sqe->user_data = slot;
+
+			start = job->rate > 0.0 ? next : now_ns();
+			if (job->rate > 0.0)
+				next += 1e9 / job->rate;
+			slots[slot].start = start;
+			slots[slot].len = len;
+			sq_tail++;
+			busy = 1;
+		}
+		if (busy) {
+			__atomic_store_n(&hdr->sq.tail, sq_tail,
+					 __ATOMIC_RELEASE);
+			if (ioctl(fd, BCM2835_SPI_RING_IOC_ENTER) < 0)
+				w->errors++;
+		}
+
+		/* reap the completions */
+		cq_tail = __atomic_load_n(&hdr->cq.tail, __ATOMIC_ACQUIRE);
+		while (cq_head != cq_tail) {
+			cqe = &cqes[cq_head & (setup.cq_entries - 1)];
+			slot = cqe->user_data;
+			buf = map + setup.data_offset + 2 * job->max_size * slot;
+			if (cqe->status) {
+				w->errors++;
+			} else {
+				hist_add(&w->hist, now_ns() - slots[slot].start);
+				check_rx(w, buf, buf + job->max_size,
+					 slots[slot].len);
+				w->ops++;
+				w->bytes += slots[slot].len;
+			}
+			free_slots[nfree++] = slot;
+			cq_head++;
+			busy = 1;
+		}
+		__atomic_store_n(&hdr->cq.head, cq_head, __ATOMIC_RELEASE);
+
+		/* sq entries the kernel could not take yet */
+		if (__atomic_load_n(&hdr->sq.head, __ATOMIC_ACQUIRE) != sq_tail)
+			ioctl(fd, BCM2835_SPI_RING_IOC_ENTER);
+
+		if (!busy) {
+			if ((!nfree) || (job->rate <= 0.0))
+				poll(&pfd, 1, 10);
+			else
+				sleep_until(next);
+		}
+	}
+
+	munmap(map, setup.map_size);
+	close(fd);
+	free(slots);
+	free(free_slots);
+	return NULL;
+}
+
+/* the busy and total jiffies of all cpus */
+static void cpu_times(uint64_t *busy, uint64_t *total)
+{
+	unsigned long long v[8] = { 0 };
+	FILE *f = fopen("/proc/stat", "r");
+
+	*busy = *total = 0;
+	if (!f)
+		return;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7])
+	    == 8) {
+		*total = v[0] + v[1] + v[2] + v[3] + v[4] + v[5] + v[6] + v[7];
+		/* everything but idle and iowait */
+		*busy = *total - v[3] - v[4];
+	}
+	fclose(f);
+}
+
+static int parse_job(char *spec, struct job *job)
+{
+	char *tok, *save = NULL, *val, *s, *save2;
+
+	memset(job, 0, sizeof(*job));
+	job->threads = 1;
+	job->min_size = job->max_size = 16;
+	job->bpw = 8;
+
+	for (tok = strtok_r(spec, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		val = strchr(tok, '=');
+		if (val)
+			*val++ = 0;
+		if (!strcmp(tok, "dev") && val) {
+			snprintf(job->dev, sizeof(job->dev), "%s", val);
+		} else if (!strcmp(tok, "threads") && val) {
+			job->threads = atoi(val);
+		} else if (!strcmp(tok, "size") && val) {
+			job->min_size = job->max_size = strtoul(val, &s, 0);
+			if (*s == '-')
+				job->max_size = strtoul(s + 1, NULL, 0);
+		} else if (!strcmp(tok, "rate") && val) {
+			job->rate = atof(val);
+		} else if (!strcmp(tok, "speed") && val) {
+			save2 = NULL;
+			for (s = strtok_r(val, "/", &save2);
+			     s && (job->nspeeds < MAX_SPEEDS);
+			     s = strtok_r(NULL, "/", &save2))
+				job->speeds[job->nspeeds++] = atof(s);
+		} else if (!strcmp(tok, "async")) {
+			job->depth = val ? atoi(val) : 8;
+		} else if (!strcmp(tok, "cs") && val) {
+			job->cs = atoi(val);
+		} else if (!strcmp(tok, "bpw") && val) {
+			job->bpw = atoi(val);
+		} else if (!strcmp(tok, "loopback")) {
+			job->loopback = 1;
+		} else {
+			fprintf(stderr, "unknown job option: %s\n", tok);
+			return -1;
+		}
+	}
+
+	if ((!job->dev[0]) || (job->threads < 1) || (!job->min_size) ||
+	    (job->max_size < job->min_size) || (job->depth < 0))
+		return -1;
+	job->max_size = round_words(job->max_size, job->bpw);
+	if (!job->nspeeds)
+		job->speeds[job->nspeeds++] = 0;
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [--time=SECONDS] --job=SPEC [--job=SPEC ...]\n"
+		"  SPEC is a comma separated list of\n"
+		"    dev=PATH        /dev/spidevB.C or /dev/spiB-ring for async\n"
+		"    threads=N       threads running this job (1)\n"
+		"    size=MIN[-MAX]  transfer length in bytes (16)\n"
+		"    rate=OPS        per thread and second (as fast as possible)\n"
+		"    speed=HZ[/HZ..] speeds to cycle through (device default)\n"
+		"    async[=DEPTH]   submit through the ring, DEPTH in flight (8)\n"
+		"    cs=N            the chip-select for async jobs (0)\n"
+		"    bpw=N           bits per word (8)\n"
+		"    loopback        MOSI is tied to MISO - verify the data\n",
+		prog);
+	exit(2);
+}
+
+static void print_result(const char *name, const struct hist *h,
+			 uint64_t ops, uint64_t bytes, uint64_t errors,
+			 uint64_t mismatches, double secs, int loopback)
+{
+	printf("%-20s %10llu %10.0f %12.0f %9.1f %9.1f %9.1f %9.1f %6llu",
+	       name, (unsigned long long)ops, ops / secs, bytes / secs,
+	       hist_percentile(h, 50.0) * 1e-3,
+	       hist_percentile(h, 99.0) * 1e-3,
+	       hist_percentile(h, 99.9) * 1e-3, h->max * 1e-3,
+	       (unsigned long long)errors);
+	if (loopback)
+		printf(" %llu mismatches", (unsigned long long)mismatches);
+	printf("\n");
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "time", required_argument, NULL, 't' },
+		{ "job", required_argument, NULL, 'j' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static struct hist total, job_hist;
+	struct worker *workers;
+	uint64_t start, elapsed, busy0, total0, busy1, total1;
+	uint64_t ops, bytes, errors, mismatches;
+	uint64_t all_ops = 0, all_bytes = 0, all_errors = 0, all_mism = 0;
+	int nworkers = 0, i, j, k, opt, any_loopback = 0;
+	double secs, duration = 10.0, cpu_s;
+	struct rusage ru;
+	char name[32];
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			duration = atof(optarg);
+			break;
+		case 'j':
+			if ((njobs == MAX_JOBS) || parse_job(optarg, &jobs[njobs]))
+				usage(argv[0]);
+			nworkers += jobs[njobs++].threads;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((!njobs) || (optind != argc))
+		usage(argv[0]);
+
+	workers = calloc(nworkers, sizeof(*workers));
+	if (!workers)
+		return 1;
+
+	signal(SIGINT, on_signal);
+	cpu_times(&busy0, &total0);
+	start = now_ns();
+
+	for (i = 0, k = 0; i < njobs; i++) {
+		for (j = 0; j < jobs[i].threads; j++, k++) {
+			workers[k].job = &jobs[i];
+			workers[k].seed = k + 1;
+			pthread_create(&workers[k].thread, NULL,
+				       jobs[i].depth ? ring_worker : sync_worker,
+				       &workers[k]);
+		}
+	}
+
+	sleep_until(start + duration * 1e9);
+	stop = 1;
+	for (k = 0; k < nworkers; k++)
+		pthread_join(workers[k].thread, NULL);
+
+	elapsed = now_ns() - start;
+	secs = elapsed * 1e-9;
+	cpu_times(&busy1, &total1);
+	getrusage(RUSAGE_SELF, &ru);
+	cpu_s = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+
+	printf("%-20s %10s %10s %12s %9s %9s %9s %9s %6s\n", "job", "ops",
+	       "ops/s", "bytes/s", "p50 us", "p99 us", "p99.9 us", "max us",
+	       "errors");
+	for (i = 0, k = 0; i < njobs; i++) {
+		memset(&job_hist, 0, sizeof(job_hist));
+		ops = bytes = errors = mismatches = 0;
+		for (j = 0; j < jobs[i].threads; j++, k++) {
+			hist_merge(&job_hist, &workers[k].hist);
+			ops += workers[k].ops;
+			bytes += workers[k].bytes;
+			errors += workers[k].errors;
+			mismatches += workers[k].mismatches;
+		}
+		hist_merge(&total, &job_hist);
+		all_ops += ops;
+		all_bytes += bytes;
+		all_errors += errors;
+		all_mism += mismatches;
+		any_loopback |= jobs[i].loopback;
+		snprintf(name, sizeof(name), "%d:%.24s", i, jobs[i].dev);
+		print_result(name, &job_hist, ops, bytes, errors, mismatches,
+			     secs, jobs[i].loopback);
+	}
+	if (njobs > 1)
+		print_result("total", &total, all_ops, all_bytes, all_errors,
+			     all_mism, secs, any_loopback);
+
+	printf("\ncpu: %.1f%% of one cpu in this process, %.1f%% of all cpus "
+	       "busy system wide\n", 100.0 * cpu_s / secs,
+	       total1 > total0 ?
+	       100.0 * (busy1 - busy0) / (total1 - total0) : 0.0);
+
+	return (all_errors || all_mism) ? 1 : 0;
+}
@@ -0,0 +1,354 @@
+/*
+ * replays a workload recorded by spi-bcm2835 (see spi-bcm2835-record.h)
+ *
+ * either against the real bus through spidev, or against a simple
+ * timing model of the controller, with the original or scaled
+ * inter-arrival times - reports throughput, latency percentiles
+ * and the cpu time used
+ *
+ * Copyright (C) 2015 Martin Sperl
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <linux/spi/spidev.h>
+
+#include "../spi-bcm2835-record.h"
+
+/* chip_select is a u8 in the recording - gpio chip-selects included */
+#define NUM_CS 256
+
+static struct {
+	int bus;
+	double scale;
+	int asap;
+	int loops;
+	/* the timing model */
+	int sim;
+	double sim_clk_hz;
+	double sim_setup_us;
+} cfg = {
+	.scale = 1.0,
+	.loops = 1,
+	.sim_setup_us = 2.0,
+};
+
+/* the spidev of each chip-select in the recording and its mode */
+static int fds[NUM_CS];
+static int modes[NUM_CS];
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ull,
+		.tv_nsec = ns % 1000000000ull,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+	       == EINTR)
+		;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* opened up front, so that the replay timing does not include it */
+static void open_cs(int cs)
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "/dev/spidev%d.%d", cfg.bus, cs);
+	fds[cs] = open(name, O_RDWR);
+	if (fds[cs] < 0) {
+		perror(name);
+		exit(1);
+	}
+}
+
+static int mode_cs(int cs, uint8_t mode)
+{
+	if (modes[cs] != mode) {
+		if (ioctl(fds[cs], SPI_IOC_WR_MODE, &mode) < 0)
+			perror("SPI_IOC_WR_MODE");
+		modes[cs] = mode;
+	}
+	return fds[cs];
+}
+
+/* the divider the driver would pick - even and rounded up */
+static double sim_cdiv(uint32_t speed_hz)
+{
+	double cdiv;
+
+	if (!speed_hz || (speed_hz >= cfg.sim_clk_hz / 2))
+		return 2;
+	cdiv = (uint64_t)((cfg.sim_clk_hz + speed_hz - 1) / speed_hz);
+	if ((uint64_t)cdiv & 1)
+		cdiv += 1;
+	return cdiv > 65536 ? 65536 : cdiv;
+}
+
+/* the modelled time of a message on the bus */
+static uint64_t sim_message(const struct bcm2835_spi_rec_msg *rm,
+			    const struct bcm2835_spi_rec_xfer *rx)
+{
+	double us = 0.0;
+	unsigned int i;
+
+	for (i = 0; i < rm->transfers; i++) {
+		/* 8 bits and the idle clock between bytes */
+		us += rx[i].len * 9.0 * sim_cdiv(rx[i].speed_hz) /
+			cfg.sim_clk_hz * 1e6;
+		us += rx[i].delay_usecs + cfg.sim_setup_us;
+	}
+	return us * 1000.0;
+}
+
+/* runs a message on the bus through spidev */
+static int run_message(const struct bcm2835_spi_rec_msg *rm,
+		       const struct bcm2835_spi_rec_xfer *rx,
+		       struct spi_ioc_transfer *xfers, uint8_t *tx, uint8_t *rx_buf)
+{
+	unsigned int i;
+	int fd;
+
+	memset(xfers, 0, rm->transfers * sizeof(*xfers));
+	for (i = 0; i < rm->transfers; i++) {
+		xfers[i].len = rx[i].len;
+		xfers[i].speed_hz = rx[i].speed_hz;
+		xfers[i].delay_usecs = rx[i].delay_usecs;
+		xfers[i].bits_per_word = rx[i].bits_per_word;
+		xfers[i].cs_change = !!(rx[i].flags &
+					BCM2835_SPI_REC_F_CS_CHANGE);
+		if (rx[i].flags & BCM2835_SPI_REC_F_TX)
+			xfers[i].tx_buf = (uintptr_t)tx;
+		if (rx[i].flags & BCM2835_SPI_REC_F_RX)
+			xfers[i].rx_buf = (uintptr_t)rx_buf;
+	}
+
+	fd = mode_cs(rm->chip_select, rm->mode);
+	return ioctl(fd, SPI_IOC_MESSAGE(rm->transfers), xfers) < 0 ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] workload\n"
+		"  --bus=N          replay on /dev/spidevN.<cs> (0)\n"
+		"  --scale=F        scale the inter-arrival times (1.0)\n"
+		"  --asap           ignore the inter-arrival times\n"
+		"  --loops=N        replay the workload N times (1)\n"
+		"  --sim[=CLK_HZ]   replay against the timing model of the\n"
+		"                   controller instead (core clock of the\n"
+		"                   recording)\n"
+		"  --sim-setup-us=US  modelled overhead per transfer (2)\n",
+		prog);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{ "bus", required_argument, NULL, 'b' },
+		{ "scale", required_argument, NULL, 's' },
+		{ "asap", no_argument, NULL, 'a' },
+		{ "loops", required_argument, NULL, 'l' },
+		{ "sim", optional_argument, NULL, 'S' },
+		{ "sim-setup-us", required_argument, NULL, 'o' },
+		{ NULL, 0, NULL, 0 }
+	};
+	struct bcm2835_spi_rec_hdr hdr;
+	const struct bcm2835_spi_rec_msg *rm;
+	const struct bcm2835_spi_rec_xfer *rx;
+	struct spi_ioc_transfer *xfers;
+	uint64_t *lat, start, arrival, begin, end, bus_free, elapsed;
+	uint64_t bytes = 0, n = 0, errors = 0;
+	uint32_t off, max_len = 0, max_xfers = 0, msgs = 0;
+	uint8_t *data, *tx, *rx_buf;
+	struct rusage ru;
+	double cpu_s;
+	int opt, loop;
+	unsigned int i;
+	FILE *f;
+
+	while ((opt = getopt_long(argc, argv, "", opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			cfg.bus = atoi(optarg);
+			break;
+		case 's':
+			cfg.scale = atof(optarg);
+			break;
+		case 'a':
+			cfg.asap = 1;
+			break;
+		case 'l':
+			cfg.loops = atoi(optarg);
+			break;
+		case 'S':
+			cfg.sim = 1;
+			if (optarg)
+				cfg.sim_clk_hz = atof(optarg);
+			break;
+		case 'o':
+			cfg.sim_setup_us = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if ((optind != argc - 1) || (cfg.loops < 1))
+		usage(argv[0]);
+
+	f = fopen(argv[optind], "r");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if ((fread(&hdr, sizeof(hdr), 1, f) != 1) ||
+	    (hdr.magic != BCM2835_SPI_REC_MAGIC) ||
+	    (hdr.version != BCM2835_SPI_REC_VERSION) ||
+	    (fseek(f, hdr.hdr_size, SEEK_SET))) {
+		fprintf(stderr, "%s: not a workload recording\n",
+			argv[optind]);
+		return 1;
+	}
+	data = malloc(hdr.data_size);
+	if ((!data) || (fread(data, 1, hdr.data_size, f) != hdr.data_size)) {
+		fprintf(stderr, "%s: truncated\n", argv[optind]);
+		return 1;
+	}
+	fclose(f);
+
+	/* validate the records, size the buffers and find the chip-selects */
+	for (i = 0; i < NUM_CS; i++) {
+		fds[i] = -1;
+		modes[i] = -1;
+	}
+	for (off = 0; off < hdr.data_size;) {
+		rm = (const void *)(data + off);
+		off += sizeof(*rm);
+		if ((off > hdr.data_size) ||
+		    (off + rm->transfers * sizeof(*rx) > hdr.data_size)) {
+			fprintf(stderr, "corrupt record at %u\n", off);
+			return 1;
+		}
+		rx = (const void *)(rm + 1);
+		for (i = 0; i < rm->transfers; i++)
+			if (rx[i].len > max_len)
+				max_len = rx[i].len;
+		if (rm->transfers > max_xfers)
+			max_xfers = rm->transfers;
+		if ((!cfg.sim) && (fds[rm->chip_select] < 0))
+			open_cs(rm->chip_select);
+		off += rm->transfers * sizeof(*rx);
+		msgs++;
+	}
+	if ((!msgs) || (!max_xfers)) {
+		fprintf(stderr, "empty recording\n");
+		return 1;
+	}
+	/* model the core clock of the recording unless told otherwise */
+	if (!cfg.sim_clk_hz)
+		cfg.sim_clk_hz = hdr.clk_hz ? hdr.clk_hz : 250e6;
+
+	tx = malloc(max_len + 1);
+	rx_buf = malloc(max_len + 1);
+	xfers = calloc(max_xfers, sizeof(*xfers));
+	lat = calloc((size_t)msgs * cfg.loops, sizeof(*lat));
+	if ((!tx) || (!rx_buf) || (!xfers) || (!lat)) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < max_len; i++)
+		tx[i] = i;
+
+	/* the simulation runs on a virtual clock starting at 0 */
+	start = cfg.sim ? 0 : now_ns();
+	arrival = start;
+	bus_free = start;
+	for (loop = 0; loop < cfg.loops; loop++) {
+		for (off = 0; off < hdr.data_size;) {
+			rm = (const void *)(data + off);
+			rx = (const void *)(rm + 1);
+			off += sizeof(*rm) + rm->transfers * sizeof(*rx);
+
+			if (!cfg.asap)
+				arrival += rm->delta_us * 1000.0 * cfg.scale;
+
+			if (cfg.sim) {
+				/* queue behind what is still on the bus */
+				begin = arrival > bus_free ? arrival : bus_free;
+				end = begin + sim_message(rm, rx);
+				bus_free = end;
+			} else {
+				if (!cfg.asap)
+					sleep_until(arrival);
+				else
+					arrival = now_ns();
+				if (run_message(rm, rx, xfers, tx, rx_buf))
+					errors++;
+				end = now_ns();
+			}
+			/* latency from the intended submission time */
+			lat[n++] = end - arrival;
+			for (i = 0; i < rm->transfers; i++)
+				bytes += rx[i].len;
+		}
+	}
+	elapsed = (cfg.sim ? bus_free : now_ns()) - start;
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu_s = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+
+	printf("mode:        %s\n", cfg.sim ? "simulated" : "spidev");
+	printf("messages:    %llu (%u recorded, %u dropped while recording)\n",
+	       (unsigned long long)n, hdr.messages, hdr.dropped);
+	printf("errors:      %llu\n", (unsigned long long)errors);
+	printf("elapsed:     %.3f s\n", elapsed * 1e-9);
+	printf("throughput:  %.0f bytes/s, %.0f messages/s\n",
+	       bytes / (elapsed * 1e-9), n / (elapsed * 1e-9));
+	printf("latency us:  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+	       lat[n * 50 / 100] * 1e-3, lat[n * 90 / 100] * 1e-3,
+	       lat[n * 99 / 100] * 1e-3, lat[n * 999 / 1000] * 1e-3,
+	       lat[n - 1] * 1e-3);
+	if (!cfg.sim)
+		printf("cpu:         %.3f s (%.1f%% of elapsed)\n",
+		       cpu_s, 100.0 * cpu_s / (elapsed * 1e-9));
+
+	return errors ? 1 : 0;
+}